@@ -0,0 +1,235 @@
+#=========================================================================
+#
+# Discover the tests in a UnitTest.h test executable, and add them to CTest.
+# This file is placed in the public domain.
+#
+#   include(UnitTest.cmake)
+#   unittest_discover_tests(target
+#     [BATCH_SIZE n]
+#     [TEST_PREFIX prefix]
+#     [WORKING_DIRECTORY dir]
+#     [DISCOVERY_TIMEOUT seconds]
+#     [PROPERTIES name value ...]
+#   )
+#
+# After the target is built, it is run with the "--list-json" option, and
+# a CTest file with the tests is written.  The test executable can run
+# several tests per process, so up to BATCH_SIZE tests (default 10) are run
+# by each CTest test, which is named after the first and last test in the
+# batch.  Tests that have the "serial" or "processors=N" property are never
+# batched.  These CTest properties are set from the test properties:
+#
+#   COST            the sum of the "cost" of the tests
+#   PROCESSORS      from "processors"
+#   RUN_SERIAL      from "serial"
+#   TIMEOUT         the sum of the "timeout" of the tests, if all have one
+#   LABELS          the "tags" of the tests
+#
+# The PROPERTIES are set for every test.  Discovery needs CMake 3.19.
+#
+#=========================================================================
+
+set(_UNITTEST_DISCOVERY_SCRIPT "${CMAKE_CURRENT_LIST_FILE}")
+
+function(unittest_discover_tests target)
+  cmake_parse_arguments(PARSE_ARGV 1 _ut ""
+    "BATCH_SIZE;TEST_PREFIX;WORKING_DIRECTORY;DISCOVERY_TIMEOUT"
+    "PROPERTIES")
+  if(NOT _ut_BATCH_SIZE)
+    set(_ut_BATCH_SIZE 10)
+  endif()
+  if(NOT _ut_WORKING_DIRECTORY)
+    set(_ut_WORKING_DIRECTORY "${CMAKE_CURRENT_BINARY_DIR}")
+  endif()
+  if(NOT _ut_DISCOVERY_TIMEOUT)
+    set(_ut_DISCOVERY_TIMEOUT 60)
+  endif()
+
+  set(ctest_file "${CMAKE_CURRENT_BINARY_DIR}/${target}_tests.cmake")
+  set(include_file "${CMAKE_CURRENT_BINARY_DIR}/${target}_include.cmake")
+
+  # Discover the tests each time that the target is built.
+  add_custom_command(TARGET ${target} POST_BUILD
+    BYPRODUCTS "${ctest_file}"
+    COMMAND "${CMAKE_COMMAND}"
+      -D "TEST_TARGET=${target}"
+      -D "TEST_EXECUTABLE=$<TARGET_FILE:${target}>"
+      -D "TEST_WORKING_DIR=${_ut_WORKING_DIRECTORY}"
+      -D "TEST_PREFIX=${_ut_TEST_PREFIX}"
+      -D "TEST_PROPERTIES=${_ut_PROPERTIES}"
+      -D "BATCH_SIZE=${_ut_BATCH_SIZE}"
+      -D "DISCOVERY_TIMEOUT=${_ut_DISCOVERY_TIMEOUT}"
+      -D "CTEST_FILE=${ctest_file}"
+      -P "${_UNITTEST_DISCOVERY_SCRIPT}"
+    VERBATIM)
+
+  file(WRITE "${include_file}"
+    "if(EXISTS \"${ctest_file}\")\n"
+    "  include(\"${ctest_file}\")\n"
+    "else()\n"
+    "  add_test(${target}_NOT_BUILT ${target}_NOT_BUILT)\n"
+    "endif()\n")
+  set_property(DIRECTORY APPEND PROPERTY TEST_INCLUDE_FILES "${include_file}")
+endfunction()
+
+# Write the add_test() for a batch of tests, and set the properties.
+function(_unittest_write_batch)
+  list(LENGTH _batch_names n)
+  if(n EQUAL 0)
+    return()
+  endif()
+  list(GET _batch_names 0 first)
+  set(name "${TEST_PREFIX}${first}")
+  if(n GREATER 1)
+    list(GET _batch_names -1 last)
+    set(name "${name}..${last}")
+  endif()
+  set(args "")
+  foreach(test_name IN LISTS _batch_names)
+    string(APPEND args " [==[${test_name}]==]")
+  endforeach()
+  set(props "")
+  if(_batch_cost GREATER 0)
+    string(APPEND props " COST ${_batch_cost}")
+  endif()
+  if(_batch_processors GREATER 1)
+    string(APPEND props " PROCESSORS ${_batch_processors}")
+  endif()
+  if(_batch_serial)
+    string(APPEND props " RUN_SERIAL TRUE")
+  endif()
+  if(_batch_timeout GREATER 0)
+    string(APPEND props " TIMEOUT ${_batch_timeout}")
+  endif()
+  if(_batch_labels)
+    list(REMOVE_DUPLICATES _batch_labels)
+    string(APPEND props " LABELS [==[${_batch_labels}]==]")
+  endif()
+  foreach(prop IN LISTS TEST_PROPERTIES)
+    string(APPEND props " [==[${prop}]==]")
+  endforeach()
+  string(APPEND _script
+    "add_test([==[${name}]==] [==[${TEST_EXECUTABLE}]==]${args})\n"
+    "set_tests_properties([==[${name}]==] PROPERTIES"
+    " WORKING_DIRECTORY [==[${TEST_WORKING_DIR}]==]${props})\n")
+  set(_script "${_script}" PARENT_SCOPE)
+endfunction()
+
+# Round a non-negative JSON number up to an integer, for math(EXPR).
+# The number can have an exponent, which moves the decimal point.
+function(_unittest_ceil var value)
+  if(NOT value MATCHES "^([0-9]+)(\\.([0-9]*))?([eE]([-+]?[0-9]+))?$")
+    set(${var} 0 PARENT_SCOPE)
+    return()
+  endif()
+  set(digits "${CMAKE_MATCH_1}${CMAKE_MATCH_3}")
+  set(exponent "${CMAKE_MATCH_5}")
+  string(LENGTH "${CMAKE_MATCH_1}" point)
+  if(NOT exponent STREQUAL "")
+    math(EXPR point "${point} + ${exponent}")
+  endif()
+  string(LENGTH "${digits}" length)
+  if(point LESS_EQUAL 0)
+    set(whole "0")
+    set(fraction "${digits}")
+  elseif(point GREATER_EQUAL length)
+    math(EXPR zeros "${point} - ${length}")
+    string(REPEAT "0" ${zeros} padding)
+    set(whole "${digits}${padding}")
+    set(fraction "")
+  else()
+    string(SUBSTRING "${digits}" 0 ${point} whole)
+    string(SUBSTRING "${digits}" ${point} -1 fraction)
+  endif()
+  # Values too large for math(EXPR) are limited.
+  string(REGEX REPLACE "^0+([0-9])" "\\1" whole "${whole}")
+  string(LENGTH "${whole}" length)
+  if(length GREATER 15)
+    set(whole "999999999999999")
+  elseif(fraction MATCHES "[1-9]")
+    math(EXPR whole "${whole} + 1")
+  endif()
+  set(${var} ${whole} PARENT_SCOPE)
+endfunction()
+
+# Reset the batch that is being collected.
+macro(_unittest_reset_batch)
+  set(_batch_names "")
+  set(_batch_labels "")
+  set(_batch_cost 0)
+  set(_batch_processors 1)
+  set(_batch_serial FALSE)
+  set(_batch_timeout 0)
+  set(_batch_untimed FALSE)
+endmacro()
+
+# The discovery step, which runs in script mode after the target is built.
+if(CMAKE_SCRIPT_MODE_FILE STREQUAL CMAKE_CURRENT_LIST_FILE)
+  cmake_minimum_required(VERSION 3.19)
+  execute_process(
+    COMMAND "${TEST_EXECUTABLE}" --list-json
+    WORKING_DIRECTORY "${TEST_WORKING_DIR}"
+    TIMEOUT ${DISCOVERY_TIMEOUT}
+    OUTPUT_VARIABLE json
+    RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR
+      "Error running ${TEST_EXECUTABLE} --list-json: ${result}")
+  endif()
+
+  set(_script "")
+  _unittest_reset_batch()
+  string(JSON count LENGTH "${json}" tests)
+  if(count GREATER 0)
+    math(EXPR last "${count} - 1")
+    foreach(i RANGE ${last})
+      string(JSON name GET "${json}" tests ${i} name)
+      string(JSON cost GET "${json}" tests ${i} cost)
+      _unittest_ceil(cost "${cost}")
+      string(JSON processors GET "${json}" tests ${i} processors)
+      string(JSON serial GET "${json}" tests ${i} serial)
+      string(JSON timeout GET "${json}" tests ${i} timeout)
+      _unittest_ceil(timeout "${timeout}")
+      string(JSON ntags LENGTH "${json}" tests ${i} tags)
+      set(tags "")
+      if(ntags GREATER 0)
+        math(EXPR lasttag "${ntags} - 1")
+        foreach(j RANGE ${lasttag})
+          string(JSON tag GET "${json}" tests ${i} tags ${j})
+          list(APPEND tags "${tag}")
+        endforeach()
+      endif()
+
+      # Tests that need special scheduling get a CTest test of their own.
+      set(alone FALSE)
+      if(serial OR processors GREATER 1)
+        set(alone TRUE)
+        _unittest_write_batch()
+        _unittest_reset_batch()
+      endif()
+
+      list(APPEND _batch_names "${name}")
+      list(APPEND _batch_labels ${tags})
+      math(EXPR _batch_cost "${_batch_cost} + ${cost}")
+      set(_batch_processors ${processors})
+      if(serial)
+        set(_batch_serial TRUE)
+      endif()
+      if(timeout GREATER 0 AND NOT _batch_untimed)
+        math(EXPR _batch_timeout "${_batch_timeout} + ${timeout}")
+      else()
+        set(_batch_untimed TRUE)
+        set(_batch_timeout 0)
+      endif()
+
+      list(LENGTH _batch_names n)
+      if(alone OR n GREATER_EQUAL BATCH_SIZE)
+        _unittest_write_batch()
+        _unittest_reset_batch()
+      endif()
+    endforeach()
+    _unittest_write_batch()
+  endif()
+
+  file(WRITE "${CTEST_FILE}" "${_script}")
+endif()
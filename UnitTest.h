@@ -11,16 +11,20 @@ This header file provides macros that can be used to facilitate the creation
 of unit tests for a C++ project.  It is designed to be portable.  Simply
 include this header from any CPP file.
 
-Some important differences as compared to UnitTest++ are:
-1. It does not provide exception checks.
-2. It does not provide time checks.
-These two features could easily be added.
+Time checks are provided by UNITTEST_TIME_CONSTRAINT(), and timing uses
+the processor's time stamp counter where it is reliable (the timer is
+described with the benchmark options in "Running Tests").
 
 
 Core Macros
 ===========
 
-Define a test block.  This causes the instantiation of a UnitTest object.
+Define a test block.  This creates a constant record that describes the
+test.  With GCC or Clang on ELF platforms, the linker gathers the records
+into a table, so registering the tests requires no code at startup (define
+UNITTEST_NO_SECTION to disable this).  On other platforms, the records are
+linked into a list during static initialization.  The test itself is only
+instantiated when it is run.
 
     TEST(name)
     {
@@ -58,6 +62,153 @@ difference is less than the given tolerance.
     CHECK_ARRAY_CLOSE(a, b, size, tolerance)
     CHECK_ARRAY2D_CLOSE(a, b, size_i, size_j, tolerance)
 
+When an array check fails, the message gives the number of mismatched
+elements and the index of the first mismatch.  Arrays with more than four
+million elements are compared in chunks, one chunk per CPU core, but the
+result is the same as for a single-threaded comparison.  The "--threads"
+option sets the number of threads that are used.  Threads require C++11,
+and can be disabled by defining UNITTEST_NO_THREADS before including the
+header.
+
+    Failed CHECK_ARRAY_EQUAL(a, b, n) with 2 mismatches, first at [77] ...
+
+Check sequences that do not have to be stored in memory.  These are read
+once, element by element, from the begin() and end() of each range or from
+a pair of input iterators (such as std::istream_iterator) for each sequence.
+The end can be a sentinel of another type.  With C++11, std::begin() and
+std::end() are used, so C arrays and views such as std::views::istream can
+also be given as ranges.
+A failure gives the position of the first mismatch, or the position where
+the shorter sequence ended.
+
+    CHECK_RANGE_EQUAL(a, b)
+    CHECK_RANGE_CLOSE(a, b, tolerance)
+    CHECK_ITERATORS_EQUAL(first_a, last_a, first_b, last_b)
+
+Check that two files are identical, or that a file is identical to a memory
+buffer.  Regular files are memory-mapped, while pipes and other special
+files are read in chunks, so neither file is ever fully read into memory.
+A failure gives the offset of the first difference, and prints a hexdump
+of the data at that offset from the first file "<" and second file ">".
+
+    CHECK_FILES_EQUAL(filename_a, filename_b)
+    CHECK_FILE_MATCHES_BUFFER(filename, data, size)
+
+Check data against a stored snapshot (a "golden" file).  The snapshot is
+stored in the "snapshots" directory, or in the directory that is given by
+the "--snapshot-dir" option or the UNITTEST_SNAPSHOT_DIR environment
+variable.  A hash of the data is stored alongside the snapshot in a file
+with the suffix ".hash", so that a matching snapshot never has to be read.
+The hash file also records the size and modification time of the snapshot,
+so a snapshot that has been edited or removed is always compared again (the
+hash file is a local cache, and need not be kept in version control).
+If the hashes differ, then the snapshot is compared byte-by-byte, as for
+CHECK_FILE_MATCHES_BUFFER(), and if the bytes match then the hash file is
+rewritten.  If the test executable is run with the "--update-snapshots"
+option, then missing or mismatched snapshots are rewritten instead of
+causing a failure.  Each file is written to a temporary file that is then
+renamed, so a snapshot is never left partially written.
+
+    CHECK_SNAPSHOT(name, data, size)
+
+Require a condition.  These are like CHECK(), CHECK_EQUAL(), and CHECK_CLOSE(),
+except that a failure ends the test immediately, so that the rest of the test
+does not run with bad values.  The test is ended by throwing an exception that
+the runner catches, so a REQUIRE must be called from the thread that is
+running the test.  The runner then continues with the next test.  If the
+code is compiled without exceptions, a REQUIRE returns from the function
+that it is in, so it should be used directly within the test.
+
+    REQUIRE(condition)
+    REQUIRE_EQUAL(a, b)
+    REQUIRE_CLOSE(a, b, tolerance)
+
+Check for exceptions.  CHECK_THROW() fails unless the expression throws an
+exception of the given type (or of a type derived from it), and
+CHECK_NOTHROW() fails if the expression throws any exception.  If a test
+throws an exception that it does not catch, then the runner catches it and
+marks the test as failed, and then continues with the next test.  These
+macros cannot be used if the code is compiled without exceptions.
+
+    CHECK_THROW(expression, type)
+    CHECK_NOTHROW(expression)
+    Failed with exception "vector::_M_range_check" TestEvents.cpp:198 ...
+
+Run code on several threads at once, to test for contention.  The function
+is called as fn(thread) for the given number of iterations on each thread,
+where "thread" counts from zero.  The threads wait at a spinning barrier so
+that they all start at the same time, and each thread is timed.  CHECK
+failures within the function are reported as usual.  The number of threads,
+the total throughput, and the spread between the fastest and the slowest
+thread are printed after the result of the test, and are also returned.
+The PINNED version pins each thread to its own CPU.  These require C++11.
+
+    UnitTestConcurrencyStats stats = UNITTEST_CONCURRENTLY(8, 100000,
+      [&](size_t thread) { queue.Push(thread); });
+    UNITTEST_CONCURRENTLY_PINNED(threads, iterations, fn)
+    Events-Queue: [Passed] (8 threads, 41920351 iterations/s, 12% spread)
+
+Check that a concurrent object is linearizable, which means that each of
+its operations appears to take effect at one instant between its call and
+its return.  A UnitTestHistory records the operations, where each thread
+calls Invoke(thread, op) before an operation and Respond(thread, result)
+after it.  The history is then checked against a sequential model of the
+object, which has the types Operation and Result, a method Apply() that
+performs an operation and returns its result, and an operator<() so that
+the search can skip states that it has already seen.  A vector of
+histories, from GetEvents(), can be checked in parallel.  A failure prints
+the shortest start of the first bad history that still fails, in the order
+of the calls, with the logical times of the calls and returns.  The history
+is only cut at a point that every operation before it has returned by, so
+the operations that are printed are never explained by ones that are not.
+
+    struct QueueModel
+    {
+      typedef QueueOperation Operation; // printable with operator<<()
+      typedef int Result;
+      std::deque<int> Items;
+      int Apply(const Operation &op);
+      bool operator<(const QueueModel &m) const { return Items < m.Items; }
+    };
+    UnitTestHistory<QueueModel> history(threads);
+    CHECK_LINEARIZABLE(QueueModel(), history)
+    Failed CHECK_LINEARIZABLE(QueueModel(), history) ...
+      1 of 1 histories are not linearizable, the first one fails at:
+      thread 1 [1, 2] push 5 -> 0
+      thread 1 [3, 4] push 6 -> 0
+      thread 2 [5, 6] pop -> 6
+
+Define a benchmark.  The code that is timed is put in a KeepRunning() loop,
+and work that should not be timed, such as resetting the data for each
+iteration, can be put between PauseTiming() and ResumeTiming().  The cost
+of a pause (mostly the time to read the clock) is measured once, and is
+subtracted from the result, so pausing does not make the loop look slower.
+The compiler can remove code whose results are never used, so results
+should be passed to UnitTestDoNotOptimize(), and UnitTestClobberMemory()
+makes the compiler assume that all memory is read and written, so that
+stores to memory are not removed.  Benchmarks have the "benchmark" property.
+
+    BENCHMARK(name)
+    {
+      std::vector<int> v(1000);
+      while (KeepRunning())
+      {
+        PauseTiming();
+        std::iota(v.rbegin(), v.rend(), 0);
+        ResumeTiming();
+        std::sort(v.begin(), v.end());
+        UnitTestDoNotOptimize(v[0]);
+      }
+    }
+    BENCHMARK_PROPERTIES(name, "tags=sort")
+
+Fail the test if the rest of the current scope takes longer than the given
+number of milliseconds.  The time is measured from the point where the
+macro is used, to the end of the scope.
+
+    UNITTEST_TIME_CONSTRAINT(ms)
+    Failed time constraint, took 12.5 ms, the limit is 10 ms Test.cxx:42 ...
+
 Define a suite, which provides a namespace for a group of related tests.
 
     SUITE(name)
@@ -76,6 +227,48 @@ tests (just put the shared code in a method of the fixture class).
       // test code where "this" is an instance of "fixture".
     }
 
+The fixture is constructed just before the test runs, and destroyed just
+after the test is done, so a fixture only uses memory while its test runs,
+and listing the tests or running a single test does not construct the
+fixtures of the other tests.
+
+Declare a fixture that is shared by all of the tests in a suite.  This is
+useful for expensive fixtures, such as large data sets that the tests only
+read.  The fixture is constructed when a test first calls SuiteFixture(),
+and it is destroyed after the last test in the suite has run.  Tests only
+have const access to the fixture, and its construction is thread-safe.
+The time taken to construct the fixture is reported separately, after the
+result of the test that constructed it.
+
+    SUITE(name)
+    {
+    SUITE_FIXTURE(fixture)
+
+    TEST(name)
+    {
+      const fixture &f = SuiteFixture();
+      // test code that reads from "f".
+    }
+    }
+
+Define a test with properties, which can be used by the tools that run the
+tests, such as CTest (see "--list-json" below).  The properties are given as a
+string of space-separated items: "tags=a,b" is a list of tags, "timeout=N"
+is a timeout in seconds, "cost=N" is the relative cost of the test,
+"processors=N" is the number of CPUs that the test uses, "serial" means
+that the test cannot run at the same time as other tests, and "inputs=a,b"
+lists the files that the test reads (see "--cache" below).
+
+    TEST_PROPERTIES(name, "tags=io,slow timeout=60 cost=10")
+    {
+      // test code
+    }
+
+    TEST_FIXTURE_PROPERTIES(fixture, name, "processors=4")
+    {
+      // test code
+    }
+
 
 Running Tests
 =============
@@ -84,12 +277,15 @@ If you run the test executable with no arguments, then it will run through
 all of the tests and print pass/fail information to stdout.  If any errors
 are encountered, they will be printed to stderr, and the executable will
 return a nonzero falue to indicate failure.  If any tests are part of a suite,
-then the name of the test will be prefixed by the suite name.
+then the name of the test will be prefixed by the suite name.  At the end,
+the number of tests that passed and failed is printed.
 
     ./TestEvents
     Events-Constructor: [Passed]
     Events-DescriptorSpecificity: [Passed]
     Events-EventMatching: [Passed]
+    Data-Load: [Passed] (suite fixture setup 1250 ms)
+    4 passed, 0 failed
 
 A single test can be run by passing the name of the test to the executable.
 If the test is within a suite, then the name must include the suite.  When
@@ -98,6 +294,158 @@ used this way, the name of the test is not printed.
     ./TestEvents Events-DescriptorSpecificity
     # returns 0 if success, prints error and returns 1 if failed
 
+If several names are given, then those tests are run in the order given,
+and their names are printed as they are when all of the tests are run.
+A single name is also run this way when "--cache" or "--order" is used, so
+that its result is saved.
+
+    ./TestEvents Events-Constructor Events-EventMatching
+    Events-Constructor: [Passed]
+    Events-EventMatching: [Passed]
+    2 passed, 0 failed
+
+The "--cache" option skips the tests that passed the last time that they
+were run with the same test executable and the same "inputs" files, and
+prints "[Cached]" for them.  Any change to the executable causes all of the
+tests to run again.  The results are kept in ".unittest_cache", or in the
+directory given by "--cache-dir" or by the UNITTEST_CACHE_DIR environment
+variable.  The "--no-cache" option runs every test, and updates the cache.
+
+    ./TestEvents --cache
+    Events-Constructor: [Cached]
+    Events-DescriptorSpecificity: [Passed]
+
+The "--order=failed-first" option runs the tests that failed within the
+last five runs before the other tests, starting with the most recent
+failures, and then runs the tests that are new.  The outcomes are kept in
+the same directory as the cache, and "--history" sets the number of runs
+that are kept.
+
+The "--max-failures" option stops the run once the given number of tests
+have failed, and "--fail-fast" stops it after the first failure.  The tests
+that were not run are listed in the summary.  Used with failed-first order,
+a broken build is reported very quickly.
+
+    ./TestEvents --order=failed-first --fail-fast
+    Events-EventMatching: [Failed]
+    Failure limit reached, these tests were not run:
+      Events-Constructor
+      Events-DescriptorSpecificity
+      Data-Load
+    0 passed, 1 failed, 3 not run
+
+On POSIX systems, a test that crashes with a signal such as SIGSEGV or
+SIGABRT is reported with "[Crashed]", followed by the location of the test
+and a backtrace.  The remaining tests are then run in a new process, which
+is started with the same arguments plus a "--resume" argument, and the
+crashed test is counted as a failure.  The order of the tests is kept in
+a file in the temporary directory ($TMPDIR or /tmp) while they run.  The
+cache and history results are saved before each test runs, so a crash does
+not lose them.  With
+"--on-crash=exit", or when a single test is run, the process is ended by
+the signal instead.  The signal handlers run on their own stack, so that
+stack overflows are also caught, both on the main thread and on the threads
+that UnitTest starts (but not on threads that a test starts for itself).
+Define UNITTEST_NO_SIGNALS before including the header to disable this.
+
+    Events-Constructor: [Crashed]
+    Crashed with SIGSEGV in Events-Constructor TestEvents.cpp:30 [UnitTest]
+
+To find tests that fail only occasionally, "--repeat=N" runs each test N
+times, and "--until-fail" repeats each test until it fails (or until it has
+run N times, if "--repeat" is also given).  The runs are made one after
+another, unless "--threads=N" is given to spread them across N threads, in
+which case the test itself must be thread-safe.  Each run has its
+own seed, UnitTest::RunSeed, which is the "--seed" value (default zero) plus
+the run number.  Tests that use this seed for their random numbers can be
+reproduced by running them once with the seed of the run that failed.
+
+    ./TestEvents --repeat=500 Events-Queue
+    Events-Queue: [Failed] 2 of 500 runs, first at run 137 with --seed=137
+    0 passed, 1 failed
+
+To look for race conditions, "--stress=N" runs each test on N threads at
+the same time.  The threads run the test in rounds, and each round starts
+when all of the threads are ready, so that the runs overlap as much as
+possible.  By default one round is run, "--repeat" gives the number of
+rounds, and "--stress-time" gives the minimum time in seconds.  Failures
+are printed with the number of the thread, which is also available to the
+test as UnitTest::StressThread.
+
+    ./TestEvents --stress=8 --stress-time=10 Events-Queue
+    [thread 3] Failed CHECK(q.size() == n) TestEvents.cpp:311 [UnitTest]
+    Events-Queue: [Failed] on threads 3 of 8, 52140 rounds
+
+Races often need a particular interleaving of the threads to show up.  The
+code that is being tested can mark places where a thread switch would be
+interesting with UNITTEST_YIELD_POINT().  When the code is compiled with
+UNITTEST_ENABLE_YIELD_POINTS defined, each yield point randomly yields,
+spins, sleeps for a few microseconds, or does nothing, but only during
+"--stress", "--repeat", and "--until-fail" runs.  Otherwise it compiles to
+nothing.  The choices come from the seed of the run and the number of the
+thread, so running again with the same "--seed" makes the same choices,
+although the timing of the threads still varies.  Code that must build
+without the header can define an empty macro instead.
+
+    #ifndef UNITTEST_YIELD_POINT
+    #define UNITTEST_YIELD_POINT()
+    #endif
+    node->next = head; UNITTEST_YIELD_POINT(); head = node;
+
+Benchmarks run their loop only once when they are run as tests, which
+checks that they still work.  The "--benchmark" option runs the benchmarks,
+or only the ones that are named, and times them.  Each benchmark is run
+with more and more iterations, until the loop takes at least half a second
+or the time given by "--benchmark-time", and the time per iteration is
+printed.
+
+On x86 processors with an invariant time stamp counter (one that runs at a
+constant rate), all timing, including benchmarks, time constraints, and
+suite fixture setup, uses the counter.  It is calibrated against the
+system's monotonic clock for 10 ms the first time that the clock is read,
+so options such as "--list" do not pay for it.  On other processors the
+monotonic clock is used, as it is when UNITTEST_NO_TSC is defined before
+including the header.  The clock and the measured cost of reading it are
+printed before the benchmarks run.
+
+    ./TestEvents --benchmark
+    Timer: TSC at 2.995 GHz, 6.1 ns per reading
+    Events-SortBenchmark: [Passed] (2416.25 ns/iteration, 289521 iterations)
+    1 passed, 0 failed
+
+Timings vary less when threads do not move between CPUs.  On Linux, the
+"--pin" option pins each worker thread (for "--repeat", "--stress",
+UNITTEST_CONCURRENTLY(), and large array checks) to its own CPU, and pins
+the benchmarks to the first CPU.  The CPUs are taken from the affinity mask
+of the process, which is already limited to the cpuset of its cgroup, and
+"--cpus=list" chooses some of them, in the given order, such as "--cpus=2-5".
+With "--pin=cores", only the first CPU of each core is used, so that two
+threads never share a core through SMT.  Unless "--threads" is given,
+UNITTEST_CONCURRENTLY() and the large array checks use one worker thread
+for each CPU that is used.  The CPUs are printed before the tests run.
+
+    ./TestEvents --benchmark --pin=cores
+    CPUs: 0-3 (one per core), allowed 0-7
+
+On systems with several NUMA nodes, memory that is on another node is
+slower to access.  With "--pin=nodes", each worker thread is pinned to all
+of the CPUs of one NUMA node, with the workers spread across the nodes in
+turn, so that the memory that a worker touches first is placed on its own
+node.  The nodes are read from /sys/devices/system/node.  Tests can also
+allocate memory on a given node, which uses mbind() to place the pages.
+The "--benchmark-numa" option measures the bandwidth and the latency of
+the memory of each node, when it is used from the CPUs of each node.
+
+    void *data = UnitTestAllocateNumaMemory(size, node);
+    UnitTestFreeNumaMemory(data, size);
+
+    ./TestEvents --benchmark-numa
+    NUMA memory benchmark, 64 MB per node
+      CPU node 0, memory node 0: 11.8 GB/s, 92.4 ns latency (local)
+      CPU node 0, memory node 1: 7.9 GB/s, 151.0 ns latency (remote)
+      CPU node 1, memory node 0: 7.7 GB/s, 149.6 ns latency (remote)
+      CPU node 1, memory node 1: 11.9 GB/s, 91.8 ns latency (local)
+
 It is also possible to list all of the tests without running them by using
 the "--list" option.
 
@@ -106,16 +454,46 @@ the "--list" option.
     Events-DescriptorSpecificity
     Events-EventMatching
 
+The "--list-json" option lists the tests as JSON, along with the file and
+line where each test is defined, and the test properties.  The list is
+read from constant data, so neither option constructs any fixtures.
+
+    ./TestEvents --list-json
+    {
+      "tests": [
+        {"name": "Events-Constructor", "suite": "Events", "file": ...
+
 When a test fails, the failure condition will be printed along with the
 line number within the test program.
 
     Failed CHECK(!w.IsExpired()) TestEvents.cpp:216 [UnitTest]
 
+If a CHECK fails repeatedly during a test, for example within a loop, then
+only the first ten failures at that CHECK are printed, followed by a count
+of the failures that were not printed.  The "--failures-per-site" option
+sets this limit, where zero means that there is no limit.
+
+    Failed CHECK(v[i] == 0) TestEvents.cpp:240 [UnitTest]
+    ...and 990 more failures at TestEvents.cpp:240 [UnitTest]
+
 
 Adding to CMake
 ===============
 
-To use the tests from cmake, the tests must be listed in the CMakeLists.txt.
+The easiest way to add the tests to cmake is with the UnitTest.cmake module,
+which requires CMake 3.19 or later.  After the test executable is built, it
+is run with "--list-json" to find the tests, so the CMakeLists.txt does not
+have to be updated when tests are added or removed.  Several tests are run
+by each CTest test, up to BATCH_SIZE tests (default 10), in order to avoid
+the cost of starting a process for every test.  The CTest properties COST,
+PROCESSORS, RUN_SERIAL, TIMEOUT, and LABELS are set from the test properties,
+and tests that are "serial" or that use several processors are not batched.
+
+    include(UnitTest.cmake)
+    add_executable(Tests Test.cxx)
+    unittest_discover_tests(Tests BATCH_SIZE 20 TEST_PREFIX "Tests:")
+
+Otherwise, the tests must be listed in the CMakeLists.txt.
 First, you have to list the names of all the tests and the executable that
 runs them.  Then, you need to add a "foreach" loop that calls add_test() for
 each test.  If you ever add or remove tests from the executable, then be sure
@@ -144,10 +522,274 @@ of the tests that it provides.
 #ifndef UNITTEST_H
 #define UNITTEST_H
 
+#include <algorithm>
+#include <exception>
 #include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <string>
+#include <map>
+#include <set>
 #include <vector>
 #include <iostream>
+#include <sstream>
+
+// Use POSIX for memory mapping and process control, where available.
+#if defined(__unix__) || defined(__APPLE__)
+#define UNITTEST_POSIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+#elif defined(_WIN32)
+#include <direct.h>
+#include <process.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+// Report crashes with POSIX signals, unless UNITTEST_NO_SIGNALS is defined.
+#if defined(UNITTEST_POSIX) && !defined(UNITTEST_NO_SIGNALS)
+#define UNITTEST_SIGNALS
+#include <signal.h>
+#if defined(__GLIBC__) || defined(__APPLE__)
+#define UNITTEST_BACKTRACE
+#include <execinfo.h>
+#endif
+#endif
+
+// Some features, such as the use of threads, require C++11.
+#if __cplusplus >= 201103L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201103L)
+#define UNITTEST_CXX11
+#include <chrono>
+#include <iterator>
+#include <type_traits>
+#endif
+
+// Threads can be disabled by defining UNITTEST_NO_THREADS.
+#if defined(UNITTEST_CXX11) && !defined(UNITTEST_NO_THREADS)
+#define UNITTEST_THREADS
+#include <atomic>
+#include <mutex>
+#include <thread>
+#endif
+
+// Exceptions are used by REQUIRE and CHECK_THROW, unless they are disabled.
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define UNITTEST_EXCEPTIONS
+#endif
+
+// Some state is per-thread, if threads are used.
+#ifdef UNITTEST_THREADS
+#define UNITTEST_THREAD_LOCAL thread_local
+#else
+#define UNITTEST_THREAD_LOCAL
+#endif
+
+// Use the x86 time stamp counter for timing, unless UNITTEST_NO_TSC is
+// defined.  It is only used if it runs at a constant rate.
+#if (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+     defined(_M_IX86)) && !defined(UNITTEST_NO_TSC)
+#define UNITTEST_TSC
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#endif
+
+// Use a linker section for the test registry, where supported.
+#if defined(__ELF__) && defined(__GNUC__) && !defined(UNITTEST_NO_SECTION)
+#define UNITTEST_SECTION
+#if defined(__has_attribute)
+#if __has_attribute(retain)
+#define UNITTEST_RETAIN retain,
+#endif
+#endif
+#ifndef UNITTEST_RETAIN
+#define UNITTEST_RETAIN
+#endif
+#endif
+
+//! A registration record for a test, it must be constant-initialized.
+struct UnitTestInfo
+{
+  const char *(*Suite)();
+  const char *Name;
+  const char *File;
+  int Line;
+  const char *Properties;
+  void (*Run)();
+  UnitTestInfo *Next;
+};
+
+#ifdef UNITTEST_SECTION
+// The linker defines these symbols at the bounds of the section.
+extern "C" UnitTestInfo __start_unittest_registry[]
+  __attribute__((weak, visibility("hidden")));
+extern "C" UnitTestInfo __stop_unittest_registry[]
+  __attribute__((weak, visibility("hidden")));
+#endif
+
+//! Get the name of a test as "suite-test", or as "test" if not in a suite.
+inline std::string UnitTestFullName(const UnitTestInfo *info)
+{
+  const char *suite = info->Suite();
+  return std::string(suite) + (suite[0] == 0 ? "" : "-") + info->Name;
+}
+
+//! A structure that counts the failures at one CHECK site.
+struct UnitTestSite
+{
+  const char *File;
+  int Line;
+  unsigned long Count;
+  UnitTestSite *Next;
+};
+
+//! A NUMA node, with the CPUs that belong to it.
+struct UnitTestNumaNode
+{
+  int Node;
+  std::vector<int> Cpus;
+};
+
+//! The exception that a REQUIRE throws to end the current test.
+struct UnitTestAbort
+{
+};
+
+//! A counter that can be shared between threads, if threads are used.
+#ifdef UNITTEST_THREADS
+typedef std::atomic<unsigned long> UnitTestCounter;
+#else
+typedef unsigned long UnitTestCounter;
+#endif
+
+//! A lock for reporting failures, which can happen on several threads.
+class UnitTestFailureLock
+{
+public:
+  UnitTestFailureLock()
+  {
+#ifdef UNITTEST_THREADS
+    Mutex().lock();
+#endif
+  }
+
+  ~UnitTestFailureLock()
+  {
+#ifdef UNITTEST_THREADS
+    Mutex().unlock();
+#endif
+  }
+
+#ifdef UNITTEST_THREADS
+private:
+  static std::mutex &Mutex()
+  {
+    static std::mutex mutex;
+    return mutex;
+  }
+#endif
+};
+
+//! A barrier that spins, so that the threads are released together.
+class UnitTestBarrier
+{
+public:
+  explicit UnitTestBarrier(size_t count)
+    : Count(count), Waiting(0), Generation(0) {}
+
+  //! Wait until all of the threads have called Wait().
+  void Wait();
+
+private:
+  UnitTestBarrier(const UnitTestBarrier &);
+  void operator=(const UnitTestBarrier &);
+
+  size_t Count;
+  UnitTestCounter Waiting;
+  UnitTestCounter Generation;
+};
+
+// The last thread to arrive starts the next generation.
+inline void UnitTestBarrier::Wait()
+{
+#ifdef UNITTEST_THREADS
+  unsigned long generation = this->Generation.load();
+  if (this->Waiting.fetch_add(1) + 1 == this->Count)
+  {
+    this->Waiting.store(0);
+    this->Generation.fetch_add(1);
+    return;
+  }
+  // Yield now and then, in case there are more threads than cores.
+  for (unsigned long spin = 1; this->Generation.load() == generation; spin++)
+  {
+    if (spin % 1024 == 0)
+    {
+      std::this_thread::yield();
+    }
+  }
+#else
+  // Without threads, the count is always one.
+  (void)this->Count;
+#endif
+}
+
+//! An alternate signal stack for a thread that the framework starts, so
+//! that a stack overflow on the thread is reported like other crashes.
+class UnitTestSignalStack
+{
+public:
+#ifdef UNITTEST_SIGNALS
+  UnitTestSignalStack() : Stack(1 << 17)
+  {
+    stack_t ss;
+    ss.ss_sp = &this->Stack[0];
+    ss.ss_size = this->Stack.size();
+    ss.ss_flags = 0;
+    sigaltstack(&ss, 0);
+  }
+
+  //! The stack must be disabled before it is freed.
+  ~UnitTestSignalStack()
+  {
+    stack_t ss;
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_flags = SS_DISABLE;
+    sigaltstack(&ss, 0);
+  }
+#else
+  UnitTestSignalStack() {}
+#endif
+
+private:
+  UnitTestSignalStack(const UnitTestSignalStack &);
+  void operator=(const UnitTestSignalStack &);
+
+#ifdef UNITTEST_SIGNALS
+  std::vector<char> Stack;
+#endif
+};
+
+struct UnitTestRepeatState;
+
+//! A record of a suite fixture that has been set up.
+struct UnitTestSuiteFixture
+{
+  const char *Suite;
+  void (*TearDown)();
+  UnitTestSuiteFixture *Next;
+};
 
 //! The base class for unit tests.
 class UnitTest
@@ -168,124 +810,4014 @@ public:
   //! A static method to run all the unit tests.
   static int RunAllTests();
 
+  //! A static method to run the given tests, and print their results.
+  static int RunTests(const std::vector<UnitTestInfo *> &tests);
+
+  //! Run the test repeatedly, this is done by each thread in RunRepeated().
+  static void RepeatWorker(UnitTestRepeatState *state, size_t thread);
+
+  //! Run the test at the same time as the other threads, for stress tests.
+  static void StressWorker(UnitTestRepeatState *state, size_t thread);
+
+  //! Move the tests that failed in the recent history to the front.
+  static void OrderFailedFirst(
+    const std::map<std::string, std::string> &history,
+    std::vector<UnitTestInfo *> *tests);
+
+  //! Run the body of a test, and catch any exceptions that it throws.
+  static void RunTestBody(UnitTestInfo *info);
+
+  //! Find a test by name, where the name is "suite-test" or "test".
+  static UnitTestInfo *FindTest(const char *name);
+
   //! A static method to print all test names to stdout.
   static void ListAllTests();
 
+  //! A static method to print all tests and their properties as JSON.
+  static void ListAllTestsJson();
+
+  //! Get a property of a test, the value is empty if it has no "=value".
+  static bool GetProperty(
+    const UnitTestInfo *info, const char *key, std::string *value);
+
+  //! Get the first registered test, or null if there are no tests.
+  static UnitTestInfo *FirstTest();
+
+  //! Get the test that follows the given test, or null.
+  static UnitTestInfo *NextTest(UnitTestInfo *info);
+
+  //! Add a test to the registry, if no linker section is used.
+  static void AddTest(UnitTestInfo *info);
+
+  //! A static method that implements the main() for TEST_MAIN().
+  static int Main(int argc, char *argv[]);
+
+  //! Mark the test as failed, return false if the message is suppressed.
+  //! If the site is null, then the message is never suppressed.
+  static bool CountFailure(UnitTestSite *site);
+
+  //! Print a summary for each CHECK site that suppressed messages.
+  static void FlushFailureSites();
+
+  //! The number of messages to print per CHECK site, or zero for no limit.
+  static unsigned long FailuresPerSite;
+
+  //! The array size at which array checks are split across threads.
+  static size_t ParallelThreshold;
+
+  //! The maximum number of threads for array checks, or zero for automatic.
+  static unsigned long MaxThreads;
+
+  //! The directory where CHECK_SNAPSHOT() stores its files.
+  static const char *SnapshotDirectory;
+
+  //! If set, CHECK_SNAPSHOT() rewrites snapshots that do not match.
+  static bool UpdateSnapshots;
+
+  //! The directory for the result cache, or null if there is no cache.
+  static const char *CacheDirectory;
+
+  //! If cleared, the cache is updated but no tests are skipped.
+  static bool UseCache;
+
+  //! Get the cache key for a test, or an empty string if it has none.
+  static std::string GetCacheKey(const UnitTestInfo *info);
+
+  //! If set, tests that failed recently are run before the other tests.
+  static bool FailedFirst;
+
+  //! The number of recent runs to keep in the history of each test.
+  static unsigned long HistoryLength;
+
+  //! Stop running tests after this many fail, or zero for no limit.
+  static unsigned long MaxFailures;
+
+  //! If set, the remaining tests are run in a new process after a crash.
+  static bool ResumeOnCrash;
+
+  //! The number of times to run each test, or zero to run each test once.
+  static unsigned long RepeatCount;
+
+  //! If set, repeat each test until it fails.
+  static bool UntilFail;
+
+  //! The seed that is given by "--seed", the default is zero.
+  static unsigned long Seed;
+
+  //! The seed for the current run of the test, for use by the test.
+  static UNITTEST_THREAD_LOCAL unsigned long RunSeed;
+
+  //! The number of threads that run each test at once, for stress tests.
+  static unsigned long StressThreads;
+
+  //! The minimum time in seconds to run each stress test for.
+  static double StressTime;
+
+  //! The stress test thread that is running, counting from one, or zero.
+  static UNITTEST_THREAD_LOCAL unsigned long StressThread;
+
+  //! If set, benchmarks are timed, instead of being run once as tests.
+  static bool Benchmarking;
+
+  //! The minimum time in seconds for the final timed batch of a benchmark.
+  static double BenchmarkTime;
+
+  //! The time that a PauseTiming() and ResumeTiming() pair adds to the
+  //! timed part of a benchmark, as measured by CalibratePause().
+  static double PauseOverhead;
+
+  //! If set, UNITTEST_YIELD_POINT() perturbs the schedule of the threads.
+  static bool YieldPoints;
+
+  //! The random state for the yield points on this thread.
+  static UNITTEST_THREAD_LOCAL uint64_t YieldState;
+
+  //! If set, worker threads and benchmarks are pinned to CPUs.
+  static bool PinThreads;
+
+  //! If set, only one CPU of each core is used for pinning.
+  static bool PinCores;
+
+  //! If set, each worker thread is pinned to all of the CPUs of a NUMA
+  //! node, and the workers are spread across the nodes.
+  static bool PinNodes;
+
+  //! The NUMA nodes that threads are pinned to, for PinNodes.
+  static std::vector<UnitTestNumaNode> PinnedNodes;
+
+  //! The CPUs to pin to, from "--cpus", or null for all allowed CPUs.
+  static const char *CpuList;
+
+  //! The CPUs that threads are pinned to, in order, after SetUpPinning().
+  static std::vector<int> PinnedCpus;
+
+  //! The CPUs that the process was allowed to use at startup.
+  static std::vector<int> ProcessCpus;
+
+  //! Choose the CPUs for pinning, and print them, or return false if none
+  //! of the requested CPUs can be used.
+  static bool SetUpPinning(std::ostream &os);
+
+  //! Get the number of threads to use for work that is split up.
+  static size_t CountThreads();
+
+  //! Measure the bandwidth and latency of memory on each NUMA node, from
+  //! the CPUs of each NUMA node, and print the results.
+  static int RunNumaBenchmark();
+
+  //! Run each test many times on several threads, and print the results.
+  static int RunRepeated(const std::vector<UnitTestInfo *> &tests);
+
+  //! Print a failure message, without mixing it with other threads.
+  static void PrintFailure(const std::string &message);
+
+  //! Add a note, which is printed after the result of the current test.
+  static void AddNote(const std::string &note);
+
+  //! Install the signal handlers that report crashes.
+  static void InstallCrashHandlers(int argc, char *argv[]);
+
+  //! Report a crash in the current test, and resume or exit.
+  static void CrashHandler(int sig);
+
+  //! Read a state file, as a map from test names to values.
+  static void ReadStateFile(
+    const std::string &filename, std::map<std::string, std::string> *values);
+
+  //! Merge new values into a state file, an empty value removes the test.
+  static void UpdateStateFile(
+    const std::string &filename,
+    const std::map<std::string, std::string> &updates);
+
+  //! Append new values to a state file, where they replace earlier lines
+  //! when it is read.  This is cheaper than a full update.
+  static void AppendStateFile(
+    const std::string &filename,
+    const std::map<std::string, std::string> &updates);
+
+  //! Get a monotonic time in seconds, for timing tests and fixtures.
+  static double GetTime();
+
+  //! Get the time from the system's monotonic clock, in seconds.
+  static double GetSystemTime();
+
+  //! Calibrate the time stamp counter against the system clock, so that
+  //! GetTime() can use it, and measure the overhead of GetTime() and of
+  //! a benchmark pause.  This is done by the first call to GetTime().
+  static void CalibrateTimer();
+
+  //! Set PauseOverhead, this is called once by CalibrateTimer().
+  static void CalibratePause();
+
+  //! Print the clock that GetTime() uses, and its overhead.
+  static void PrintTimer(std::ostream &os);
+
+  //! The seconds per tick of the time stamp counter, or zero if unused.
+  static double TickSeconds;
+
+  //! The time stamp counter and the system time at calibration.
+  static uint64_t TickBase;
+  static double TickOrigin;
+
+  //! The time that one call to GetTime() takes, in seconds.
+  static double TimerOverhead;
+
+  //! Set when CalibrateTimer() has finished.
+  static UnitTestCounter TimerReady;
+
+  //! Set on the thread that is running CalibrateTimer(), so that its own
+  //! calls to GetTime() cost the same as they will after calibration.
+  static UNITTEST_THREAD_LOCAL bool TimerCalibrating;
+
+  //! Register a suite fixture that was set up, and how long it took.
+  static void AddSuiteFixture(
+    const char *suite, void (*teardown)(), double seconds);
+
+  //! Tear down the suite fixtures for a suite, or for all suites if null.
+  static void TearDownSuiteFixtures(const char *suite);
+
 protected:
-  //! Create a unit test and register it with the test driver.
+  //! Create a unit test, this is done just before the test is run.
   UnitTest(const char *suite, const char *name);
 
   //! This method is overridden to run the test.
   virtual void operator() () = 0;
 
-  //! A list of all registered tests.
-  static std::vector<UnitTest *> *Tests;
+  //! A list of all registered tests, if no linker section is used.
+  static UnitTestInfo *TestList;
+
+  //! The link that the next registered test will be stored in.
+  static UnitTestInfo **TestListTail;
+
+  //! This is set once the tests in the linker section have been sorted.
+  static bool TestsSorted;
 
   //! A boolean that is set if any test fails.
   static bool TestFailed;
 
+  //! The CHECK sites that have failed during the current test.
+  static UnitTestSite *FailedSites;
+
+  //! The number of failures that were counted on this thread.
+  static UNITTEST_THREAD_LOCAL unsigned long ThreadFailures;
+
+  //! The suite fixtures that are currently set up.
+  static UnitTestSuiteFixture *SuiteFixtures;
+
+  //! The time spent setting up suite fixtures during the current test.
+  static double SetupTime;
+
+  //! The notes that have been added during the current test.
+  static std::string TestNotes;
+
+  //! The path to the test executable, as given by argv[0].
+  static const char *Executable;
+
+  //! The test that is running, so that crashes can be reported.
+  static UnitTestInfo *volatile CurrentTest;
+
+  //! The arguments for running the remaining tests after a crash.
+  static char **ResumeArgv;
+
+  //! The "--resume" argument, which is empty unless a test list is running.
+  static char ResumeArg[4096];
+
+  //! The "--resume" value that this process was started with, or null.
+  static const char *ResumePoint;
+
+  //! The file that lists the running tests in order, for "--resume".
+  static std::string ResumeFile;
+
+  //! Write the ResumeFile, or disable resuming if it cannot be written.
+  static void WriteResumeFile(const std::vector<UnitTestInfo *> &tests);
+
+  //! Read the test names from a file that was written by WriteResumeFile.
+  static bool ReadResumeFile(
+    const std::string &filename, std::vector<std::string> *names);
+
+  //! Set the "--resume" argument before a test in the list is run, where
+  //! next is the index in the ResumeFile of the test after it.
+  static void SetResumePoint(
+    size_t next, size_t passed, size_t failed, size_t cached);
+
+  //! Match "--option=value" and return a pointer to the value.
+  static bool MatchOption(const char *arg, const char *option,
+                          const char **value);
+
+  //! Convert the value of an option to an unsigned integer.
+  static bool ParseCount(const char *value, unsigned long *count);
+
 private:
+  //! Print the name of a test, and reset the results of the last test.
+  static void StartTest(UnitTestInfo *info);
+
+  //! Print the suite fixture setup time and the notes of the test.
+  static void PrintTestNotes();
+
+  //! Find the index of the last test of each suite.
+  static std::map<std::string, size_t> FindLastTests(
+    const std::vector<UnitTestInfo *> &tests);
+
+  //! End the line of test i, and tear down the suite fixtures after the
+  //! last test of its suite.
+  static void FinishTest(
+    const std::vector<UnitTestInfo *> &tests,
+    const std::map<std::string, size_t> &lastTests, size_t i);
+
+  //! Print the tests from index "next" on as not run, and the totals.
+  static void PrintSummary(
+    const std::vector<UnitTestInfo *> &tests, size_t next,
+    size_t passed, size_t failed, size_t cached);
+
   const char *UnitTestSuite;
   const char *UnitTestName;
+};
 
-  friend class UnitTestInitializer;
+//! Sort order for tests: files in link order, then by line number.
+struct UnitTestInfoOrder
+{
+  std::map<std::string, size_t> FileRank;
+
+  bool operator()(const UnitTestInfo &a, const UnitTestInfo &b) const
+  {
+    size_t ra = this->FileRank.find(a.File)->second;
+    size_t rb = this->FileRank.find(b.File)->second;
+    return (ra < rb || (ra == rb && a.Line < b.Line));
+  }
 };
 
-//! An internal class that initializes the list of unit tests.
-static class UnitTestInitializer
+//! Registers a test at static initialization, if no section is used.
+class UnitTestRegistrar
 {
 public:
-  UnitTestInitializer();
-  ~UnitTestInitializer();
-} unitTestSchwarzCounter;
+  explicit UnitTestRegistrar(UnitTestInfo *info) { UnitTest::AddTest(info); }
+};
 
-// Constructor adds the test to the list of tests.
+// Constructor stores the names.
 inline UnitTest::UnitTest(const char *suite, const char *name)
   : UnitTestSuite(suite), UnitTestName(name)
 {
-  UnitTest::Tests->push_back(this);
 }
 
-// Get the name of the suite.
-inline const char *UnitTest::GetSuiteName()
+// The registry is a table in a linker section, or a linked list.
+inline UnitTestInfo *UnitTest::FirstTest()
 {
-  return UnitTestSuite;
+#ifdef UNITTEST_SECTION
+  UnitTestInfo *info = __start_unittest_registry;
+  if (!UnitTest::TestsSorted)
+  {
+    // Compilers can emit a file's records in any order, so sort them.
+    UnitTestInfoOrder order;
+    for (UnitTestInfo *t = info; t != __stop_unittest_registry; t++)
+    {
+      order.FileRank.insert(
+        std::make_pair(std::string(t->File), order.FileRank.size()));
+    }
+    std::stable_sort(info, __stop_unittest_registry, order);
+    UnitTest::TestsSorted = true;
+  }
+  return (info != __stop_unittest_registry ? info : 0);
+#else
+  return UnitTest::TestList;
+#endif
 }
 
-// Get the name of the test.
-inline const char *UnitTest::GetTestName()
+// Walk the table or the list.
+inline UnitTestInfo *UnitTest::NextTest(UnitTestInfo *info)
 {
-  return UnitTestName;
+#ifdef UNITTEST_SECTION
+  info++;
+  return (info != __stop_unittest_registry ? info : 0);
+#else
+  return info->Next;
+#endif
 }
 
-// Run one of the tests by name.
+// Append to the list, so that tests are kept in the order of definition.
+inline void UnitTest::AddTest(UnitTestInfo *info)
+{
+  *UnitTest::TestListTail = info;
+  UnitTest::TestListTail = &info->Next;
+}
+
+// Get the name of the suite.
+inline const char *UnitTest::GetSuiteName()
+{
+  return UnitTestSuite;
+}
+
+// Get the name of the test.
+inline const char *UnitTest::GetTestName()
+{
+  return UnitTestName;
+}
+
+// Find one of the tests by name.
+inline UnitTestInfo *UnitTest::FindTest(const char *test)
+{
+  // Look for a hyphen, denoting suite-test.
+  size_t suiteLen = 0;
+  const char *suite = "";
+  const char *cp = test;
+  while (*cp != '\0' && *cp != '-') { cp++; }
+  if (*cp == '-')
+  {
+    suite = test;
+    suiteLen = cp - test;
+  }
+  // The 'stest' is the remainder, after the hyphen.
+  const char *stest = test + suiteLen + (suiteLen > 0 ? 1 : 0);
+  for (UnitTestInfo *t = UnitTest::FirstTest(); t; t = UnitTest::NextTest(t))
+  {
+    // First check that the suite name matches.
+    const char *tsuite = t->Suite();
+    if ((suiteLen == 0 && *tsuite == '\0') ||
+        (suiteLen > 0 && strncmp(tsuite, suite, suiteLen) == 0 &&
+         tsuite[suiteLen] == '\0'))
+    {
+      // Check that the test name maches.
+      if (strcmp(t->Name, stest) == 0)
+      {
+        return t;
+      }
+    }
+  }
+  std::cerr << "Unknown test \"" << test << "\" for file " << __FILE__ << "\n";
+  return 0;
+}
+
+// Run one of the tests by name.
 inline int UnitTest::RunTest(const char *test)
 {
-  // Look for a hyphen, denoting suite-test.
-  size_t suiteLen = 0;
-  const char *suite = "";
-  const char *cp = test;
-  while (*cp != '\0' && *cp != '-') { cp++; }
-  if (*cp == '-')
+  UnitTestInfo *t = UnitTest::FindTest(test);
+  if (t == 0)
+  {
+    return 1;
+  }
+  UnitTest::TestFailed = false;
+  UnitTest::CurrentTest = t;
+  UnitTest::RunTestBody(t);
+  UnitTest::CurrentTest = 0;
+  UnitTest::FlushFailureSites();
+  UnitTest::TearDownSuiteFixtures(0);
+  return UnitTest::TestFailed;
+}
+
+//! Call a function, and fail the test if it throws an exception.  The
+//! where text, such as " on thread 2", is added to the failure message.
+//! The abort thrown by a REQUIRE has already been counted as a failure.
+template<class Function>
+void UnitTestContainExceptions(
+  Function function, const std::string &where, const char *file, int line)
+{
+  std::string what;
+#ifdef UNITTEST_EXCEPTIONS
+  try
+  {
+    function();
+  }
+  catch (const UnitTestAbort &)
+  {
+  }
+  catch (const std::exception &e)
+  {
+    what = std::string("exception \"") + e.what() + "\"";
+  }
+  catch (...)
+  {
+    what = "unknown exception";
+  }
+#else
+  function();
+#endif
+  if (!what.empty() && UnitTest::CountFailure(0))
+  {
+    std::ostringstream message;
+    message << "Failed with " << what << where << " " << file << ":"
+            << line << " [UnitTest]\n";
+    UnitTest::PrintFailure(message.str());
+  }
+}
+
+// An exception fails the test, so that the next test can run.
+inline void UnitTest::RunTestBody(UnitTestInfo *info)
+{
+  UnitTestContainExceptions(info->Run, "", info->File, info->Line);
+}
+
+//! Add an outcome to a test's history, and keep only the latest outcomes.
+inline std::string UnitTestAddOutcome(
+  const std::string &history, char outcome, size_t length)
+{
+  std::string h = history + outcome;
+  return h.substr(h.length() > length ? h.length() - length : 0);
+}
+
+// The name is printed before the test runs, in case the test crashes.
+inline void UnitTest::StartTest(UnitTestInfo *info)
+{
+  UnitTest::TestFailed = false;
+  UnitTest::SetupTime = 0.0;
+  UnitTest::TestNotes.clear();
+  std::cout << UnitTestFullName(info) << ": ";
+  std::cout.flush();
+}
+
+// The suite fixture setup time is reported separately from the test.
+inline void UnitTest::PrintTestNotes()
+{
+  if (UnitTest::SetupTime > 0.0)
+  {
+    std::cout << " (suite fixture setup "
+              << static_cast<long>(UnitTest::SetupTime*1000.0 + 0.5)
+              << " ms)";
+  }
+  if (!UnitTest::TestNotes.empty())
+  {
+    std::cout << " (" << UnitTest::TestNotes << ")";
+  }
+}
+
+// Find the last test of each suite, for tearing down suite fixtures.
+inline std::map<std::string, size_t> UnitTest::FindLastTests(
+  const std::vector<UnitTestInfo *> &tests)
+{
+  std::map<std::string, size_t> lastTests;
+  for (size_t j = 0; j < tests.size(); j++)
+  {
+    lastTests[tests[j]->Suite()] = j;
+  }
+  return lastTests;
+}
+
+// A suite's fixtures are not needed after the last test of the suite.
+inline void UnitTest::FinishTest(
+  const std::vector<UnitTestInfo *> &tests,
+  const std::map<std::string, size_t> &lastTests, size_t i)
+{
+  std::cout << std::endl;
+  const char *suite = tests[i]->Suite();
+  std::map<std::string, size_t>::const_iterator it = lastTests.find(suite);
+  if (it != lastTests.end() && it->second == i)
+  {
+    UnitTest::TearDownSuiteFixtures(suite);
+  }
+}
+
+// Print a summary, with the names of any tests that were cancelled.
+inline void UnitTest::PrintSummary(
+  const std::vector<UnitTestInfo *> &tests, size_t next,
+  size_t passed, size_t failed, size_t cached)
+{
+  if (next < tests.size())
+  {
+    std::cout << "Failure limit reached, these tests were not run:\n";
+    for (size_t j = next; j < tests.size(); j++)
+    {
+      std::cout << "  " << UnitTestFullName(tests[j]) << "\n";
+    }
+  }
+  std::cout << passed << " passed, " << failed << " failed";
+  if (cached > 0)
+  {
+    std::cout << ", " << cached << " cached";
+  }
+  if (next < tests.size())
+  {
+    std::cout << ", " << (tests.size() - next) << " not run";
+  }
+  std::cout << std::endl;
+}
+
+// Run all of the tests in the registry.
+inline int UnitTest::RunAllTests()
+{
+  std::vector<UnitTestInfo *> tests;
+  for (UnitTestInfo *t = UnitTest::FirstTest(); t; t = UnitTest::NextTest(t))
+  {
+    tests.push_back(t);
+  }
+  return UnitTest::RunTests(tests);
+}
+
+// Run all of the tests in the list.
+inline int UnitTest::RunTests(const std::vector<UnitTestInfo *> &testList)
+{
+  bool anyFailed = false;
+  size_t passed = 0;
+  size_t failed = 0;
+  size_t skipped = 0;
+  // The cache and the history are kept in the same directory.
+  const char *directory = UnitTest::CacheDirectory;
+  if (directory == 0 && UnitTest::FailedFirst)
+  {
+    directory = ".unittest_cache";
+  }
+  std::string cacheFile;
+  std::string historyFile;
+  std::map<std::string, std::string> cache;
+  std::map<std::string, std::string> history;
+  std::map<std::string, std::string> cacheUpdates;
+  std::map<std::string, std::string> historyUpdates;
+  bool cacheAppended = false;
+  bool historyAppended = false;
+  if (directory != 0)
+  {
+    cacheFile = std::string(directory) + "/results";
+    historyFile = std::string(directory) + "/history";
+    UnitTest::ReadStateFile(historyFile, &history);
+  }
+  if (UnitTest::CacheDirectory != 0 && UnitTest::UseCache)
+  {
+    UnitTest::ReadStateFile(cacheFile, &cache);
+  }
+  std::vector<UnitTestInfo *> tests = testList;
+  if (UnitTest::ResumePoint != 0)
+  {
+    // After a crash, the counts are carried over, and the tests after the
+    // crashed one are read from the list that the crashed process wrote,
+    // since the history that gave their order might have been changed.
+    unsigned long npassed = 0, nfailed = 0, ncached = 0, next = 0;
+    int n = 0;
+    sscanf(UnitTest::ResumePoint, "%lu,%lu,%lu,%lu,%n",
+           &npassed, &nfailed, &ncached, &next, &n);
+    passed = npassed;
+    failed = nfailed;
+    skipped = ncached;
+    anyFailed = (failed > 0);
+    std::map<std::string, UnitTestInfo *> byName;
+    for (size_t j = 0; j < testList.size(); j++)
+    {
+      byName[UnitTestFullName(testList[j])] = testList[j];
+    }
+    tests.clear();
+    std::vector<std::string> names;
+    if (n == 0 || next == 0 ||
+        !UnitTest::ReadResumeFile(UnitTest::ResumePoint + n, &names))
+    {
+      std::cerr << "Could not resume from \"" << UnitTest::ResumePoint
+                << "\" [UnitTest]\n";
+      anyFailed = true;
+    }
+    for (size_t j = next - 1; j < names.size(); j++)
+    {
+      if (j == next - 1 && directory != 0)
+      {
+        cacheUpdates[names[j]] = std::string();
+        historyUpdates[names[j]] = UnitTestAddOutcome(
+          history[names[j]], 'F', UnitTest::HistoryLength);
+      }
+      else if (j >= next && byName.find(names[j]) != byName.end())
+      {
+        tests.push_back(byName[names[j]]);
+      }
+    }
+  }
+  else if (UnitTest::FailedFirst)
+  {
+    UnitTest::OrderFailedFirst(history, &tests);
+  }
+  UnitTest::WriteResumeFile(tests);
+  size_t i = 0;
+  std::map<std::string, size_t> lastTests = UnitTest::FindLastTests(tests);
+  bool stop = (UnitTest::MaxFailures != 0 && failed >= UnitTest::MaxFailures);
+  for (; i < tests.size() && !stop; i++)
+  {
+    UnitTestInfo *t = tests[i];
+    std::string name = UnitTestFullName(t);
+    UnitTest::StartTest(t);
+    // A test is skipped if it passed with the same executable and inputs.
+    std::string key;
+    if (UnitTest::CacheDirectory != 0)
+    {
+      key = UnitTest::GetCacheKey(t);
+    }
+    std::map<std::string, std::string>::iterator cached = cache.find(name);
+    if (!key.empty() && cached != cache.end() && cached->second == key)
+    {
+      std::cout << "[Cached]";
+      skipped++;
+    }
+    else
+    {
+      // A crash ends the process, so the results so far are saved first.
+      if (!cacheUpdates.empty())
+      {
+        UnitTest::AppendStateFile(cacheFile, cacheUpdates);
+        cacheUpdates.clear();
+        cacheAppended = true;
+      }
+      if (!historyUpdates.empty())
+      {
+        UnitTest::AppendStateFile(historyFile, historyUpdates);
+        historyUpdates.clear();
+        historyAppended = true;
+      }
+      // If the test crashes, the new process counts it as failed.
+      UnitTest::SetResumePoint(i + 1, passed, failed + 1, skipped);
+      UnitTest::CurrentTest = t;
+      UnitTest::RunTestBody(t);
+      UnitTest::CurrentTest = 0;
+      UnitTest::FlushFailureSites();
+      std::cout << (UnitTest::TestFailed ? "[Failed]" : "[Passed]");
+      (UnitTest::TestFailed ? failed : passed)++;
+      UnitTest::PrintTestNotes();
+      if (!key.empty())
+      {
+        cacheUpdates[name] = (UnitTest::TestFailed ? std::string() : key);
+      }
+      if (directory != 0)
+      {
+        historyUpdates[name] = UnitTestAddOutcome(
+          history[name], (UnitTest::TestFailed ? 'F' : 'P'),
+          UnitTest::HistoryLength);
+      }
+    }
+    UnitTest::FinishTest(tests, lastTests, i);
+    anyFailed |= UnitTest::TestFailed;
+    stop = (UnitTest::MaxFailures != 0 && failed >= UnitTest::MaxFailures);
+  }
+  UnitTest::ResumeArg[0] = '\0';
+  if (!UnitTest::ResumeFile.empty())
+  {
+    remove(UnitTest::ResumeFile.c_str());
+  }
+  UnitTest::TearDownSuiteFixtures(0);
+  UnitTest::PrintSummary(tests, i, passed, failed, skipped);
+  // Rewrite the files without the lines that were appended during the run.
+  if (!cacheUpdates.empty() || cacheAppended)
+  {
+    UnitTest::UpdateStateFile(cacheFile, cacheUpdates);
+  }
+  if (!historyUpdates.empty() || historyAppended)
+  {
+    UnitTest::UpdateStateFile(historyFile, historyUpdates);
+  }
+  UnitTest::TestFailed = anyFailed;
+  return UnitTest::TestFailed;
+}
+
+//! The state that is shared by the threads that repeat a test.
+struct UnitTestRepeatState
+{
+  UnitTestInfo *Test;
+  unsigned long Limit;
+  bool StopOnFailure;
+  UnitTestCounter Next;
+  UnitTestCounter Runs;
+  UnitTestCounter Stop;
+  unsigned long Failures;
+  unsigned long FirstFailure;
+  // For stress tests, where all threads run the test at the same time.
+  UnitTestBarrier *Barrier;
+  double EndTime;
+  std::vector<unsigned long> ThreadFailures;
+};
+
+//! Parse a list of CPUs such as "0-3,8", as used by Linux.
+inline bool UnitTestParseCpuList(const char *text, std::vector<int> *cpus)
+{
+  const char *cp = text;
+  while (*cp != '\0' && *cp != '\n')
+  {
+    char *end;
+    long first = strtol(cp, &end, 10);
+    long last = first;
+    if (end == cp || first < 0)
+    {
+      return false;
+    }
+    if (*end == '-')
+    {
+      cp = end + 1;
+      last = strtol(cp, &end, 10);
+      if (end == cp || last < first)
+      {
+        return false;
+      }
+    }
+    for (long cpu = first; cpu <= last; cpu++)
+    {
+      cpus->push_back(static_cast<int>(cpu));
+    }
+    cp = end + (*end == ',' ? 1 : 0);
+    if (*end != ',' && *end != '\0' && *end != '\n')
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+//! Format a list of CPUs, with ranges such as "0-3,8".
+inline std::string UnitTestFormatCpuList(const std::vector<int> &cpus)
+{
+  std::ostringstream text;
+  for (size_t i = 0; i < cpus.size(); )
+  {
+    size_t j = i + 1;
+    while (j < cpus.size() && cpus[j] == cpus[j - 1] + 1)
+    {
+      j++;
+    }
+    text << (i == 0 ? "" : ",") << cpus[i];
+    if (j - i > 1)
+    {
+      text << "-" << cpus[j - 1];
+    }
+    i = j;
+  }
+  return text.str();
+}
+
+//! Set the CPU affinity of the calling thread, return false on failure.
+inline bool UnitTestSetAffinity(const std::vector<int> &cpus)
+{
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (size_t i = 0; i < cpus.size(); i++)
+  {
+    if (cpus[i] < CPU_SETSIZE)
+    {
+      CPU_SET(cpus[i], &set);
+    }
+  }
+  return (!cpus.empty() && sched_setaffinity(0, sizeof(set), &set) == 0);
+#else
+  (void)cpus;
+  return false;
+#endif
+}
+
+//! Get the CPUs in the affinity mask of the calling thread.
+inline std::vector<int> UnitTestGetAllowedCpus()
+{
+  std::vector<int> cpus;
+#if defined(__linux__)
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+  {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+      if (CPU_ISSET(cpu, &allowed))
+      {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  return cpus;
+}
+
+//! Read the NUMA nodes and their CPUs from sysfs, the list is empty if
+//! the system does not provide them.
+inline std::vector<UnitTestNumaNode> UnitTestGetNumaNodes()
+{
+  std::vector<UnitTestNumaNode> nodes;
+#if defined(__linux__)
+  char line[1024];
+  std::vector<int> online;
+  FILE *fp = fopen("/sys/devices/system/node/online", "r");
+  if (fp != 0)
+  {
+    if (fgets(line, sizeof(line), fp) != 0)
+    {
+      UnitTestParseCpuList(line, &online);
+    }
+    fclose(fp);
+  }
+  for (size_t i = 0; i < online.size(); i++)
+  {
+    char path[96];
+    UnitTestNumaNode node;
+    node.Node = online[i];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             online[i]);
+    fp = fopen(path, "r");
+    if (fp != 0)
+    {
+      if (fgets(line, sizeof(line), fp) != 0)
+      {
+        UnitTestParseCpuList(line, &node.Cpus);
+      }
+      fclose(fp);
+    }
+    nodes.push_back(node);
+  }
+#endif
+  return nodes;
+}
+
+//! Bind memory to a NUMA node with mbind(), so that its pages are placed
+//! on that node.  The memory must start on a page boundary.
+inline bool UnitTestBindMemory(void *data, size_t size, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+  const int bits = 8*sizeof(unsigned long);
+  unsigned long mask[1024/bits] = { 0 };
+  if (node < 0 || node >= 1024)
+  {
+    return false;
+  }
+  mask[node/bits] |= 1ul << (node % bits);
+  // These are MPOL_BIND and MPOL_MF_MOVE from <numaif.h>.
+  return (syscall(SYS_mbind, data, size, 2, mask, 1024ul, 2) == 0);
+#else
+  (void)data;
+  (void)size;
+  (void)node;
+  return false;
+#endif
+}
+
+//! Allocate memory on a NUMA node, or return null on failure.  The memory
+//! must be freed with UnitTestFreeNumaMemory().
+inline void *UnitTestAllocateNumaMemory(size_t size, int node)
+{
+#if defined(__linux__)
+  void *data = mmap(0, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED)
+  {
+    return 0;
+  }
+  if (!UnitTestBindMemory(data, size, node))
+  {
+    munmap(data, size);
+    return 0;
+  }
+  return data;
+#else
+  (void)size;
+  (void)node;
+  return 0;
+#endif
+}
+
+//! Free memory from UnitTestAllocateNumaMemory().
+inline void UnitTestFreeNumaMemory(void *data, size_t size)
+{
+#if defined(__linux__)
+  if (data != 0)
+  {
+    munmap(data, size);
+  }
+#else
+  (void)data;
+  (void)size;
+#endif
+}
+
+//! Pin the calling thread to one of the CPUs that the process can use,
+//! or one of the CPUs that were chosen with "--cpus" and "--pin=cores".
+//! With "--pin=nodes", the thread is pinned to the CPUs of a NUMA node
+//! instead, so that the memory it touches first is placed on that node.
+inline bool UnitTestPinThread(size_t index)
+{
+#if defined(__linux__)
+  if (!UnitTest::PinnedNodes.empty())
+  {
+    size_t n = UnitTest::PinnedNodes.size();
+    return UnitTestSetAffinity(UnitTest::PinnedNodes[index % n].Cpus);
+  }
+  std::vector<int> cpus = UnitTest::PinnedCpus;
+  if (cpus.empty())
+  {
+    cpus = UnitTestGetAllowedCpus();
+  }
+  // Threads are given the CPUs in order, wrapping around.
+  return (!cpus.empty() &&
+          UnitTestSetAffinity(std::vector<int>(1, cpus[index % cpus.size()])));
+#else
+  (void)index;
+  return false;
+#endif
+}
+
+//! Let the calling thread run on any of the CPUs again.
+inline void UnitTestUnpinThread()
+{
+  if (!UnitTest::ProcessCpus.empty())
+  {
+    UnitTestSetAffinity(UnitTest::ProcessCpus);
+  }
+}
+
+// The affinity mask of the process is already limited to its cgroup's
+// cpuset.  For one CPU per core, the first CPU of each set of siblings is
+// kept, in the order of the list.
+inline bool UnitTest::SetUpPinning(std::ostream &os)
+{
+#if defined(__linux__)
+  UnitTest::ProcessCpus = UnitTestGetAllowedCpus();
+  if (UnitTest::ProcessCpus.empty())
+  {
+    os << "CPUs: not pinned, the affinity mask is not available\n";
+    return true;
+  }
+  std::vector<int> cpus = UnitTest::ProcessCpus;
+  std::vector<int> &allowed = UnitTest::ProcessCpus;
+  if (UnitTest::CpuList != 0)
+  {
+    std::vector<int> requested;
+    UnitTestParseCpuList(UnitTest::CpuList, &requested);
+    cpus.clear();
+    for (size_t i = 0; i < requested.size(); i++)
+    {
+      if (std::find(allowed.begin(), allowed.end(), requested[i]) !=
+            allowed.end() &&
+          std::find(cpus.begin(), cpus.end(), requested[i]) == cpus.end())
+      {
+        cpus.push_back(requested[i]);
+      }
+    }
+  }
+  if (UnitTest::PinCores)
+  {
+    std::vector<int> cores;
+    for (size_t i = 0; i < cpus.size(); i++)
+    {
+      char path[96];
+      char line[256];
+      std::vector<int> siblings;
+      snprintf(path, sizeof(path),
+               "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+               cpus[i]);
+      FILE *fp = fopen(path, "r");
+      if (fp != 0)
+      {
+        if (fgets(line, sizeof(line), fp) != 0)
+        {
+          UnitTestParseCpuList(line, &siblings);
+        }
+        fclose(fp);
+      }
+      bool shared = false;
+      for (size_t j = 0; j < cores.size(); j++)
+      {
+        shared |= (std::find(siblings.begin(), siblings.end(), cores[j]) !=
+                   siblings.end());
+      }
+      if (!shared)
+      {
+        cores.push_back(cpus[i]);
+      }
+    }
+    cpus.swap(cores);
+  }
+  if (cpus.empty())
+  {
+    std::cerr << "None of the CPUs \"" << UnitTest::CpuList
+              << "\" can be used, the allowed CPUs are "
+              << UnitTestFormatCpuList(UnitTest::ProcessCpus) << "\n";
+    return false;
+  }
+  UnitTest::PinnedCpus = cpus;
+  os << "CPUs: " << UnitTestFormatCpuList(cpus)
+     << (UnitTest::PinCores ? " (one per core)" : "") << ", allowed "
+     << UnitTestFormatCpuList(UnitTest::ProcessCpus) << "\n";
+  if (UnitTest::PinNodes)
+  {
+    // Keep the chosen CPUs of each node, and the nodes that have any.
+    std::vector<UnitTestNumaNode> nodes = UnitTestGetNumaNodes();
+    UnitTest::PinnedNodes.clear();
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+      UnitTestNumaNode node;
+      node.Node = nodes[i].Node;
+      for (size_t j = 0; j < cpus.size(); j++)
+      {
+        if (std::find(nodes[i].Cpus.begin(), nodes[i].Cpus.end(),
+                      cpus[j]) != nodes[i].Cpus.end())
+        {
+          node.Cpus.push_back(cpus[j]);
+        }
+      }
+      if (!node.Cpus.empty())
+      {
+        UnitTest::PinnedNodes.push_back(node);
+      }
+    }
+    os << "NUMA nodes:";
+    for (size_t i = 0; i < UnitTest::PinnedNodes.size(); i++)
+    {
+      os << (i == 0 ? " " : ", ") << UnitTest::PinnedNodes[i].Node << " ("
+         << UnitTestFormatCpuList(UnitTest::PinnedNodes[i].Cpus) << ")";
+    }
+    os << (UnitTest::PinnedNodes.empty() ? " not available\n" : "\n");
+  }
+#else
+  os << "CPUs: not pinned, affinity is only supported on Linux\n";
+#endif
+  return true;
+}
+
+// Use the thread count from "--threads", or one thread per pinned CPU,
+// or one thread per CPU.
+inline size_t UnitTest::CountThreads()
+{
+#ifdef UNITTEST_THREADS
+  if (UnitTest::MaxThreads != 0)
+  {
+    return UnitTest::MaxThreads;
+  }
+  if (!UnitTest::PinnedCpus.empty())
+  {
+    return UnitTest::PinnedCpus.size();
+  }
+  size_t threads = std::thread::hardware_concurrency();
+  return (threads > 0 ? threads : 1);
+#else
+  return 1;
+#endif
+}
+
+// Each thread takes the next run number, until the runs are done.
+inline void UnitTest::RepeatWorker(UnitTestRepeatState *state, size_t thread)
+{
+  if (UnitTest::PinThreads)
+  {
+    UnitTestPinThread(thread);
+  }
+  while (state->Stop == 0)
+  {
+    unsigned long i = state->Next++;
+    if (state->Limit != 0 && i >= state->Limit)
+    {
+      break;
+    }
+    unsigned long failures = UnitTest::ThreadFailures;
+    UnitTest::RunSeed = UnitTest::Seed + i;
+    UnitTest::YieldState = UnitTest::RunSeed;
+    UnitTest::RunTestBody(state->Test);
+    state->Runs++;
+    if (UnitTest::ThreadFailures != failures)
+    {
+      UnitTestFailureLock lock;
+      if (state->Failures++ == 0 || i < state->FirstFailure)
+      {
+        state->FirstFailure = i;
+      }
+      if (state->StopOnFailure)
+      {
+        state->Stop = 1;
+      }
+    }
+  }
+}
+
+// The threads run the test in rounds, which start at the same time.
+// The first thread decides whether to run another round.
+inline void UnitTest::StressWorker(UnitTestRepeatState *state, size_t thread)
+{
+  size_t threads = state->ThreadFailures.size();
+  bool limited = (state->Limit != 0 || UnitTest::StressTime > 0.0 ||
+                  !UnitTest::UntilFail);
+  unsigned long rounds = (state->Limit != 0 ? state->Limit : 1);
+  UnitTest::StressThread = thread + 1;
+  if (UnitTest::PinThreads)
+  {
+    UnitTestPinThread(thread);
+  }
+  for (unsigned long round = 0; ; round++)
+  {
+    if (thread == 0)
+    {
+      bool done = (limited && round >= rounds &&
+                   UnitTest::GetTime() >= state->EndTime);
+      done |= (state->StopOnFailure && UnitTest::TestFailed);
+      state->Stop = done;
+    }
+    state->Barrier->Wait();
+    if (state->Stop != 0)
+    {
+      break;
+    }
+    unsigned long failures = UnitTest::ThreadFailures;
+    UnitTest::RunSeed = UnitTest::Seed + round*threads + thread;
+    UnitTest::YieldState = UnitTest::RunSeed;
+    UnitTest::RunTestBody(state->Test);
+    if (UnitTest::ThreadFailures != failures)
+    {
+      state->ThreadFailures[thread]++;
+    }
+    if (thread == 0)
+    {
+      state->Runs++;
+    }
+    // Wait for the round to end, before the first thread checks for failures.
+    state->Barrier->Wait();
+  }
+  UnitTest::StressThread = 0;
+}
+
+// Run the tests one at a time, and spread the runs of each test across
+// the threads.  The messages for each CHECK are limited across all runs.
+inline int UnitTest::RunRepeated(const std::vector<UnitTestInfo *> &tests)
+{
+  size_t passed = 0;
+  size_t failed = 0;
+  size_t i = 0;
+  bool stop = false;
+  UnitTest::YieldPoints = true;
+  std::map<std::string, size_t> lastTests = UnitTest::FindLastTests(tests);
+  for (; i < tests.size() && !stop; i++)
+  {
+    UnitTestInfo *t = tests[i];
+    UnitTestRepeatState state;
+    state.Test = t;
+    state.Limit = UnitTest::RepeatCount;
+    state.Next = 0;
+    state.Runs = 0;
+    state.Stop = 0;
+    state.Failures = 0;
+    state.FirstFailure = 0;
+    state.Barrier = 0;
+    state.EndTime = UnitTest::GetTime() + UnitTest::StressTime;
+    // Stop early if one more failure would reach the failure limit.
+    state.StopOnFailure = (UnitTest::UntilFail ||
+      (UnitTest::MaxFailures != 0 && failed + 1 >= UnitTest::MaxFailures));
+    UnitTest::StartTest(t);
+    UnitTest::CurrentTest = t;
+    void (*worker)(UnitTestRepeatState *, size_t) = &UnitTest::RepeatWorker;
+    size_t threads = 1;
+#ifdef UNITTEST_THREADS
+    // Repeated runs are only concurrent when "--threads" asks for it, since
+    // many tests are not thread-safe.
+    threads = (UnitTest::MaxThreads != 0 ? UnitTest::MaxThreads : 1);
+    if (state.Limit != 0 && state.Limit < threads)
+    {
+      threads = state.Limit;
+    }
+    if (UnitTest::StressThreads != 0)
+    {
+      threads = UnitTest::StressThreads;
+    }
+#endif
+    UnitTestBarrier barrier(threads);
+    if (UnitTest::StressThreads != 0)
+    {
+      worker = &UnitTest::StressWorker;
+      state.Barrier = &barrier;
+      state.ThreadFailures.resize(threads, 0);
+    }
+#ifdef UNITTEST_THREADS
+    std::vector<std::thread> workers;
+    for (size_t k = 1; k < threads; k++)
+    {
+      workers.push_back(std::thread([&state, worker, k]()
+      {
+        UnitTestSignalStack stack;
+        worker(&state, k);
+      }));
+    }
+    worker(&state, 0);
+    for (size_t k = 0; k < workers.size(); k++)
+    {
+      workers[k].join();
+    }
+    if (UnitTest::PinThreads)
+    {
+      UnitTestUnpinThread();
+    }
+#else
+    worker(&state, 0);
+#endif
+    UnitTest::CurrentTest = 0;
+    UnitTest::FlushFailureSites();
+    unsigned long runs = state.Runs;
+    if (!state.ThreadFailures.empty())
+    {
+      // Give the threads that failed, and the number of rounds.
+      std::cout << (UnitTest::TestFailed ? "[Failed]" : "[Passed]");
+      const char *separator = " on threads ";
+      for (size_t k = 0; k < threads; k++)
+      {
+        if (state.ThreadFailures[k] != 0)
+        {
+          std::cout << separator << (k + 1);
+          separator = ", ";
+        }
+      }
+      std::cout << (separator[0] == ',' ? " of " : " ") << threads
+                << (separator[0] == ',' ? ", " : " threads, ") << runs
+                << " rounds";
+    }
+    else if (!UnitTest::TestFailed)
+    {
+      std::cout << "[Passed] " << runs << " runs";
+    }
+    else if (state.Failures == 0)
+    {
+      // A failure on a thread that the test started has no run number.
+      std::cout << "[Failed] in " << runs << " runs";
+    }
+    else
+    {
+      std::cout << "[Failed] " << state.Failures << " of " << runs
+                << " runs, first at run " << state.FirstFailure
+                << " with --seed=" << (UnitTest::Seed + state.FirstFailure);
+    }
+    UnitTest::PrintTestNotes();
+    UnitTest::FinishTest(tests, lastTests, i);
+    (UnitTest::TestFailed ? failed : passed)++;
+    stop = (UnitTest::MaxFailures != 0 && failed >= UnitTest::MaxFailures);
+  }
+  UnitTest::YieldPoints = false;
+  UnitTest::TearDownSuiteFixtures(0);
+  UnitTest::PrintSummary(tests, i, passed, failed, 0);
+  UnitTest::TestFailed = (failed > 0);
+  return UnitTest::TestFailed;
+}
+
+//! Mix the bits of a 64-bit value (the finalizer of SplitMix64).
+inline uint64_t UnitTestMix(uint64_t x)
+{
+  x = (x ^ (x >> 30))*((static_cast<uint64_t>(0xbf58476d) << 32) | 0x1ce4e5b9);
+  x = (x ^ (x >> 27))*((static_cast<uint64_t>(0x94d049bb) << 32) | 0x133111eb);
+  return x ^ (x >> 31);
+}
+
+//! Randomly yield, spin, or sleep, see UNITTEST_YIELD_POINT().
+inline void UnitTestYieldPoint()
+{
+#ifdef UNITTEST_THREADS
+  if (!UnitTest::YieldPoints)
+  {
+    return;
+  }
+  UnitTest::YieldState +=
+    (static_cast<uint64_t>(0x9e3779b9) << 32) | 0x7f4a7c15;
+  uint64_t r = UnitTestMix(UnitTest::YieldState);
+  // Half of the time nothing happens, so that the code also runs at speed.
+  switch (r & 7)
+  {
+    case 0:
+    case 1:
+      std::this_thread::yield();
+      break;
+    case 2:
+      {
+        volatile unsigned long spin = (r >> 3) % 4096;
+        while (spin > 0)
+        {
+          spin = spin - 1;
+        }
+      }
+      break;
+    case 3:
+      std::this_thread::sleep_for(
+        std::chrono::microseconds((r >> 3) % 100));
+      break;
+    default:
+      break;
+  }
+#endif
+}
+
+// The memory is bound to each node in turn, and is read sequentially for
+// the bandwidth, and by following a random cycle of pointers through its
+// cache lines for the latency.
+inline int UnitTest::RunNumaBenchmark()
+{
+  std::vector<UnitTestNumaNode> nodes = UnitTestGetNumaNodes();
+  if (nodes.empty())
+  {
+    std::cerr << "The NUMA topology is not available on this system\n";
+    return 1;
+  }
+  const size_t size = static_cast<size_t>(64) << 20;
+  const size_t lines = size/64;
+  std::vector<int> allowed = UnitTestGetAllowedCpus();
+  std::cout << "NUMA memory benchmark, " << (size >> 20) << " MB per node\n";
+  bool failed = false;
+  for (size_t i = 0; i < nodes.size(); i++)
+  {
+    // Only the CPUs that the process is allowed to use can be tested.
+    std::vector<int> cpus;
+    for (size_t k = 0; k < nodes[i].Cpus.size(); k++)
+    {
+      if (std::find(allowed.begin(), allowed.end(), nodes[i].Cpus[k]) !=
+          allowed.end())
+      {
+        cpus.push_back(nodes[i].Cpus[k]);
+      }
+    }
+    if (cpus.empty() || !UnitTestSetAffinity(cpus))
+    {
+      continue;
+    }
+    for (size_t j = 0; j < nodes.size(); j++)
+    {
+      std::cout << "  CPU node " << nodes[i].Node << ", memory node "
+                << nodes[j].Node << ": ";
+      uint64_t *data = static_cast<uint64_t *>(
+        UnitTestAllocateNumaMemory(size, nodes[j].Node));
+      if (data == 0)
+      {
+        std::cout << "cannot bind memory to the node" << std::endl;
+        failed = true;
+        continue;
+      }
+      // Link the cache lines into one random cycle, which also places
+      // all of the pages.
+      std::vector<size_t> order(lines);
+      for (size_t k = 0; k < lines; k++)
+      {
+        order[k] = k;
+      }
+      for (size_t k = lines - 1; k > 0; k--)
+      {
+        std::swap(order[k], order[UnitTestMix(k) % (k + 1)]);
+      }
+      for (size_t k = 0; k < lines; k++)
+      {
+        data[order[k]*8] = order[(k + 1) % lines]*8;
+      }
+      double best = 0.0;
+      uint64_t sum = 0;
+      for (int pass = 0; pass < 3; pass++)
+      {
+        double t = UnitTest::GetTime();
+        for (size_t k = 0; k < size/sizeof(uint64_t); k++)
+        {
+          sum += data[k];
+        }
+        t = UnitTest::GetTime() - t;
+        best = (pass == 0 || t < best ? t : best);
+      }
+      double t = UnitTest::GetTime();
+      uint64_t index = 0;
+      for (size_t k = 0; k < lines; k++)
+      {
+        index = data[index];
+      }
+      t = UnitTest::GetTime() - t;
+      // The results are stored, so that the loops are not removed.
+      volatile uint64_t sink = sum + index;
+      (void)sink;
+      std::ostringstream text;
+      text.setf(std::ios::fixed);
+      text.precision(1);
+      text << (size/best*1e-9) << " GB/s, " << (t/lines*1e9)
+           << " ns latency" << (i == j ? " (local)" : " (remote)");
+      std::cout << text.str() << std::endl;
+      UnitTestFreeNumaMemory(data, size);
+    }
+  }
+  UnitTestSetAffinity(allowed);
+  return failed;
+}
+
+// Sort by the most recent failure, then put new tests before old tests.
+inline void UnitTest::OrderFailedFirst(
+  const std::map<std::string, std::string> &history,
+  std::vector<UnitTestInfo *> *tests)
+{
+  std::vector<std::pair<size_t, size_t> > ranks;
+  for (size_t i = 0; i < tests->size(); i++)
+  {
+    std::map<std::string, std::string>::const_iterator it =
+      history.find(UnitTestFullName((*tests)[i]));
+    size_t rank = UnitTest::HistoryLength + 1;
+    if (it == history.end())
+    {
+      rank = UnitTest::HistoryLength;
+    }
+    else if (it->second.rfind('F') != std::string::npos)
+    {
+      rank = it->second.length() - 1 - it->second.rfind('F');
+    }
+    ranks.push_back(std::make_pair(rank, i));
+  }
+  std::sort(ranks.begin(), ranks.end());
+  std::vector<UnitTestInfo *> ordered;
+  for (size_t i = 0; i < ranks.size(); i++)
+  {
+    ordered.push_back((*tests)[ranks[i].second]);
+  }
+  tests->swap(ordered);
+}
+
+// List the tests to stdout.
+inline void UnitTest::ListAllTests()
+{
+  for (UnitTestInfo *t = UnitTest::FirstTest(); t; t = UnitTest::NextTest(t))
+  {
+    const char *suite = t->Suite();
+    std::cout << suite << (suite[0] == 0 ? "" : "-") << t->Name << "\n";
+  }
+}
+
+// Find "key" or "key=value" in the whitespace-separated properties.
+inline bool UnitTest::GetProperty(
+  const UnitTestInfo *info, const char *key, std::string *value)
+{
+  size_t n = strlen(key);
+  const char *cp = info->Properties;
+  while (*cp != '\0')
+  {
+    while (*cp == ' ' || *cp == '\t') { cp++; }
+    const char *token = cp;
+    while (*cp != '\0' && *cp != ' ' && *cp != '\t') { cp++; }
+    if (token != cp && strncmp(token, key, n) == 0 &&
+        (token + n == cp || token[n] == '='))
+    {
+      value->assign(token + n + (token + n == cp ? 0 : 1), cp);
+      return true;
+    }
+  }
+  value->clear();
+  return false;
+}
+
+//! Print a number in fixed-point form, without an exponent, so that the
+//! CMake module can read it.  Trailing zeros are removed.
+inline void UnitTestPrintJsonNumber(std::ostream &os, double value)
+{
+  std::ostringstream text;
+  text.setf(std::ios::fixed);
+  text.precision(6);
+  text << value;
+  std::string number = text.str();
+  number.erase(number.find_last_not_of('0') + 1);
+  if (number[number.length() - 1] == '.')
+  {
+    number.erase(number.length() - 1);
+  }
+  os << number;
+}
+
+//! Print a string as a quoted JSON string.
+inline void UnitTestPrintJson(std::ostream &os, const std::string &text)
+{
+  static const char hex[] = "0123456789abcdef";
+  os << "\"";
+  for (size_t i = 0; i < text.length(); i++)
+  {
+    unsigned char c = text[i];
+    if (c == '"' || c == '\\')
+    {
+      os << "\\" << c;
+    }
+    else if (c < 0x20)
+    {
+      os << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+    }
+    else
+    {
+      os << c;
+    }
+  }
+  os << "\"";
+}
+
+// Print the metadata, which is read from the constant test records.
+inline void UnitTest::ListAllTestsJson()
+{
+  std::ostream &os = std::cout;
+  os << "{\n  \"tests\": [";
+  const char *separator = "\n";
+  for (UnitTestInfo *t = UnitTest::FirstTest(); t; t = UnitTest::NextTest(t))
+  {
+    std::string suite = t->Suite();
+    std::string value;
+    os << separator << "    {\"name\": ";
+    UnitTestPrintJson(os, suite + (suite.empty() ? "" : "-") + t->Name);
+    os << ", \"suite\": ";
+    UnitTestPrintJson(os, suite);
+    os << ", \"file\": ";
+    UnitTestPrintJson(os, t->File);
+    os << ", \"line\": " << t->Line << ", \"tags\": [";
+    UnitTest::GetProperty(t, "tags", &value);
+    for (size_t i = 0, j = 0; j < value.length(); i = j + 1)
+    {
+      j = value.find(',', i);
+      j = (j == std::string::npos ? value.length() : j);
+      os << (i == 0 ? "" : ", ");
+      UnitTestPrintJson(os, value.substr(i, j - i));
+    }
+    UnitTest::GetProperty(t, "timeout", &value);
+    os << "], \"timeout\": ";
+    UnitTestPrintJsonNumber(os, atof(value.c_str()));
+    UnitTest::GetProperty(t, "cost", &value);
+    os << ", \"cost\": ";
+    UnitTestPrintJsonNumber(os, atof(value.c_str()));
+    UnitTest::GetProperty(t, "processors", &value);
+    os << ", \"processors\": " << (value.empty() ? 1 : atoi(value.c_str()));
+    os << ", \"serial\": "
+       << (UnitTest::GetProperty(t, "serial", &value) ? "true" : "false")
+       << "}";
+    separator = ",\n";
+  }
+  os << "\n  ]\n}\n";
+}
+
+// Use the highest-resolution monotonic clock that is available.  The
+// clock is calibrated when it is first used, so listing tests is quick.
+inline double UnitTest::GetTime()
+{
+  if (UnitTest::TimerReady == 0 && !UnitTest::TimerCalibrating)
+  {
+    UnitTest::CalibrateTimer();
+  }
+#ifdef UNITTEST_TSC
+  if (UnitTest::TickSeconds > 0.0)
+  {
+    int64_t ticks = static_cast<int64_t>(__rdtsc() - UnitTest::TickBase);
+    return UnitTest::TickOrigin + ticks*UnitTest::TickSeconds;
+  }
+#endif
+  return UnitTest::GetSystemTime();
+}
+
+// Use the most precise monotonic clock.
+inline double UnitTest::GetSystemTime()
+{
+#if defined(UNITTEST_CXX11)
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+#elif defined(UNITTEST_POSIX)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+#else
+  return static_cast<double>(clock())/CLOCKS_PER_SEC;
+#endif
+}
+
+#ifdef UNITTEST_TSC
+//! Check whether the time stamp counter is invariant, which means that it
+//! runs at a constant rate, even when the CPU changes its frequency.
+inline bool UnitTestInvariantTSC()
+{
+#if defined(_MSC_VER)
+  int regs[4];
+  __cpuid(regs, 0x80000000);
+  if (static_cast<unsigned int>(regs[0]) < 0x80000007u)
+  {
+    return false;
+  }
+  __cpuid(regs, 0x80000007);
+  return ((regs[3] & 0x100) != 0);
+#else
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid_max(0x80000000u, 0) < 0x80000007u ||
+      !__get_cpuid(0x80000007u, &eax, &ebx, &ecx, &edx))
+  {
+    return false;
+  }
+  return ((edx & 0x100) != 0);
+#endif
+}
+
+//! Read the counter between two readings of the system clock, and keep
+//! the closest pair, so that both are for almost the same instant.
+inline void UnitTestPairClocks(double *seconds, uint64_t *ticks)
+{
+  double best = 0.0;
+  for (int i = 0; i < 10; i++)
+  {
+    double t0 = UnitTest::GetSystemTime();
+    uint64_t c = __rdtsc();
+    double t1 = UnitTest::GetSystemTime();
+    if (i == 0 || t1 - t0 < best)
+    {
+      best = t1 - t0;
+      *seconds = 0.5*(t0 + t1);
+      *ticks = c;
+    }
+  }
+}
+#endif
+
+// The counter is compared with the system clock over 10 milliseconds.
+// Other threads wait for the calibration, but the calls to GetTime()
+// that it makes itself skip the lock, so that they are timed correctly.
+inline void UnitTest::CalibrateTimer()
+{
+#ifdef UNITTEST_THREADS
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
+#endif
+  if (UnitTest::TimerReady != 0)
+  {
+    return;
+  }
+  UnitTest::TimerCalibrating = true;
+#ifdef UNITTEST_TSC
+  if (UnitTestInvariantTSC())
+  {
+    double t0, t1;
+    uint64_t c0, c1;
+    UnitTestPairClocks(&t0, &c0);
+    while (UnitTest::GetSystemTime() - t0 < 0.01)
+    {
+    }
+    UnitTestPairClocks(&t1, &c1);
+    if (c1 > c0 && t1 > t0)
+    {
+      UnitTest::TickBase = c0;
+      UnitTest::TickOrigin = t0;
+      UnitTest::TickSeconds = (t1 - t0)/(c1 - c0);
+    }
+  }
+#endif
+  // Keep the fastest of several tries, to avoid counting interruptions.
+  const int n = 1000;
+  double best = 0.0;
+  for (int k = 0; k < 10; k++)
+  {
+    double t0 = UnitTest::GetTime();
+    for (int i = 1; i < n; i++)
+    {
+      UnitTest::GetTime();
+    }
+    double t = (UnitTest::GetTime() - t0)/n;
+    best = (k == 0 || t < best ? t : best);
+  }
+  UnitTest::TimerOverhead = best;
+  UnitTest::CalibratePause();
+  UnitTest::TimerCalibrating = false;
+  UnitTest::TimerReady = 1;
+}
+
+// For example "Timer: TSC at 2.995 GHz, 6.1 ns per reading".
+inline void UnitTest::PrintTimer(std::ostream &os)
+{
+  UnitTest::CalibrateTimer();
+  std::ostringstream text;
+  text.setf(std::ios::fixed);
+  text.precision(3);
+  text << "Timer: ";
+  if (UnitTest::TickSeconds > 0.0)
+  {
+    text << "TSC at " << (1e-9/UnitTest::TickSeconds) << " GHz, ";
+  }
+  else
+  {
+    text << "system clock, ";
+  }
+  text.precision(1);
+  text << (UnitTest::TimerOverhead*1e9) << " ns per reading\n";
+  os << text.str();
+}
+
+// Add a fixture to the list, this is called with the fixture lock held.
+inline void UnitTest::AddSuiteFixture(
+  const char *suite, void (*teardown)(), double seconds)
+{
+  UnitTestSuiteFixture *fixture = new UnitTestSuiteFixture;
+  fixture->Suite = suite;
+  fixture->TearDown = teardown;
+  fixture->Next = UnitTest::SuiteFixtures;
+  UnitTest::SuiteFixtures = fixture;
+  UnitTest::SetupTime += seconds;
+}
+
+// Count a failure, the site is added to the list on its first failure.
+inline bool UnitTest::CountFailure(UnitTestSite *site)
+{
+  UnitTestFailureLock lock;
+  UnitTest::TestFailed = true;
+  UnitTest::ThreadFailures++;
+  if (site == 0)
+  {
+    return true;
+  }
+  if (site->Count++ == 0)
+  {
+    site->Next = UnitTest::FailedSites;
+    UnitTest::FailedSites = site;
+  }
+  return (UnitTest::FailuresPerSite == 0 ||
+          site->Count <= UnitTest::FailuresPerSite);
+}
+
+// Notes are separated by commas, and printed within parentheses.  When a
+// test is repeated, a note is kept only once, and the total is limited.
+inline void UnitTest::AddNote(const std::string &note)
+{
+  UnitTestFailureLock lock;
+  std::string &notes = UnitTest::TestNotes;
+  if ((", " + notes + ", ").find(", " + note + ", ") != std::string::npos ||
+      notes.length() > 1000)
+  {
+    return;
+  }
+  if (note.length() + notes.length() > 1000)
+  {
+    notes += ", ...";
+    return;
+  }
+  if (!notes.empty())
+  {
+    notes += ", ";
+  }
+  notes += note;
+}
+
+// Write the whole message at once, so that it stays in one piece.
+inline void UnitTest::PrintFailure(const std::string &message)
+{
+  UnitTestFailureLock lock;
+  if (UnitTest::StressThread != 0)
+  {
+    std::cerr << "[thread " << UnitTest::StressThread << "] ";
+  }
+  std::cerr << message;
+  std::cerr.flush();
+}
+
+// Summarize the suppressed messages, and reset the sites for the next test.
+inline void UnitTest::FlushFailureSites()
+{
+  UnitTestFailureLock lock;
+  UnitTestSite *site = UnitTest::FailedSites;
+  UnitTest::FailedSites = 0;
+  while (site != 0)
+  {
+    if (UnitTest::FailuresPerSite != 0 &&
+        site->Count > UnitTest::FailuresPerSite)
+    {
+      std::cerr << "...and " << (site->Count - UnitTest::FailuresPerSite)
+                << " more failures at " << site->File << ":" << site->Line
+                << " [UnitTest]\n";
+    }
+    UnitTestSite *next = site->Next;
+    site->Count = 0;
+    site->Next = 0;
+    site = next;
+  }
+  std::cerr.flush();
+}
+
+// Check for "--option=value", the value is set to the text after the "=".
+inline bool UnitTest::MatchOption(
+  const char *arg, const char *option, const char **value)
+{
+  size_t n = strlen(option);
+  if (strncmp(arg, option, n) == 0 && arg[n] == '=')
+  {
+    *value = arg + n + 1;
+    return true;
+  }
+  return false;
+}
+
+// Convert a decimal string, return false if it is not a valid number.
+inline bool UnitTest::ParseCount(const char *value, unsigned long *count)
+{
+  char *end;
+  *count = strtoul(value, &end, 10);
+  return (end != value && *end == '\0' && *value != '-');
+}
+
+// Parse the command-line arguments and run the tests.
+inline int UnitTest::Main(int argc, char *argv[])
+{
+  std::vector<UnitTestInfo *> tests;
+  const char *test = 0;
+  bool numaBenchmark = false;
+  UnitTest::Executable = argv[0];
+  if (getenv("UNITTEST_SNAPSHOT_DIR") != 0 && *getenv("UNITTEST_SNAPSHOT_DIR"))
+  {
+    UnitTest::SnapshotDirectory = getenv("UNITTEST_SNAPSHOT_DIR");
+  }
+  if (getenv("UNITTEST_CACHE_DIR") != 0 && *getenv("UNITTEST_CACHE_DIR"))
+  {
+    UnitTest::CacheDirectory = getenv("UNITTEST_CACHE_DIR");
+  }
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    const char *value = 0;
+    bool badValue = false;
+    if (arg[0] != '-')
+    {
+      UnitTestInfo *t = UnitTest::FindTest(arg);
+      if (t == 0)
+      {
+        return 1;
+      }
+      tests.push_back(t);
+      test = arg;
+    }
+    else if (strcmp("--list", arg) == 0)
+    {
+      UnitTest::ListAllTests();
+      return 0;
+    }
+    else if (strcmp("--list-json", arg) == 0)
+    {
+      UnitTest::ListAllTestsJson();
+      return 0;
+    }
+    else if (UnitTest::MatchOption(arg, "--failures-per-site", &value))
+    {
+      badValue = !UnitTest::ParseCount(value, &UnitTest::FailuresPerSite);
+    }
+    else if (UnitTest::MatchOption(arg, "--threads", &value))
+    {
+      badValue = !UnitTest::ParseCount(value, &UnitTest::MaxThreads);
+    }
+    else if (UnitTest::MatchOption(arg, "--snapshot-dir", &value))
+    {
+      UnitTest::SnapshotDirectory = value;
+      badValue = (*value == '\0');
+    }
+    else if (strcmp("--update-snapshots", arg) == 0)
+    {
+      UnitTest::UpdateSnapshots = true;
+    }
+    else if (strcmp("--cache", arg) == 0)
+    {
+      if (UnitTest::CacheDirectory == 0)
+      {
+        UnitTest::CacheDirectory = ".unittest_cache";
+      }
+    }
+    else if (UnitTest::MatchOption(arg, "--cache-dir", &value))
+    {
+      UnitTest::CacheDirectory = value;
+      badValue = (*value == '\0');
+    }
+    else if (strcmp("--no-cache", arg) == 0)
+    {
+      UnitTest::UseCache = false;
+    }
+    else if (UnitTest::MatchOption(arg, "--order", &value))
+    {
+      UnitTest::FailedFirst = (strcmp(value, "failed-first") == 0);
+      badValue = (!UnitTest::FailedFirst && strcmp(value, "defined") != 0);
+    }
+    else if (UnitTest::MatchOption(arg, "--history", &value))
+    {
+      badValue = !UnitTest::ParseCount(value, &UnitTest::HistoryLength);
+      badValue |= (UnitTest::HistoryLength == 0);
+    }
+    else if (strcmp("--fail-fast", arg) == 0)
+    {
+      UnitTest::MaxFailures = 1;
+    }
+    else if (UnitTest::MatchOption(arg, "--on-crash", &value))
+    {
+      UnitTest::ResumeOnCrash = (strcmp(value, "resume") == 0);
+      badValue = (!UnitTest::ResumeOnCrash && strcmp(value, "exit") != 0);
+    }
+    else if (UnitTest::MatchOption(arg, "--resume", &value))
+    {
+      UnitTest::ResumePoint = value;
+    }
+    else if (UnitTest::MatchOption(arg, "--repeat", &value))
+    {
+      badValue = !UnitTest::ParseCount(value, &UnitTest::RepeatCount);
+      badValue |= (UnitTest::RepeatCount == 0);
+    }
+    else if (strcmp("--until-fail", arg) == 0)
+    {
+      UnitTest::UntilFail = true;
+    }
+    else if (UnitTest::MatchOption(arg, "--seed", &value))
+    {
+      badValue = !UnitTest::ParseCount(value, &UnitTest::Seed);
+    }
+    else if (UnitTest::MatchOption(arg, "--stress", &value))
+    {
+      badValue = !UnitTest::ParseCount(value, &UnitTest::StressThreads);
+      badValue |= (UnitTest::StressThreads == 0);
+#ifndef UNITTEST_THREADS
+      // Without threads, the test can only be run on one thread.
+      UnitTest::StressThreads = 1;
+#endif
+    }
+    else if (UnitTest::MatchOption(arg, "--stress-time", &value))
+    {
+      char *end;
+      UnitTest::StressTime = strtod(value, &end);
+      badValue = (end == value || *end != '\0' || UnitTest::StressTime < 0);
+    }
+    else if (UnitTest::MatchOption(arg, "--max-failures", &value))
+    {
+      badValue = !UnitTest::ParseCount(value, &UnitTest::MaxFailures);
+    }
+    else if (strcmp("--pin", arg) == 0)
+    {
+      UnitTest::PinThreads = true;
+    }
+    else if (UnitTest::MatchOption(arg, "--pin", &value))
+    {
+      UnitTest::PinThreads = true;
+      UnitTest::PinCores = (strcmp(value, "cores") == 0);
+      UnitTest::PinNodes = (strcmp(value, "nodes") == 0);
+      badValue = (!UnitTest::PinCores && !UnitTest::PinNodes &&
+                  strcmp(value, "cpus") != 0);
+    }
+    else if (UnitTest::MatchOption(arg, "--cpus", &value))
+    {
+      std::vector<int> cpus;
+      UnitTest::PinThreads = true;
+      UnitTest::CpuList = value;
+      badValue = (!UnitTestParseCpuList(value, &cpus) || cpus.empty());
+    }
+    else if (strcmp("--benchmark", arg) == 0)
+    {
+      UnitTest::Benchmarking = true;
+    }
+    else if (strcmp("--benchmark-numa", arg) == 0)
+    {
+      numaBenchmark = true;
+    }
+    else if (UnitTest::MatchOption(arg, "--benchmark-time", &value))
+    {
+      char *end;
+      UnitTest::Benchmarking = true;
+      UnitTest::BenchmarkTime = strtod(value, &end);
+      badValue = (end == value || *end != '\0' ||
+                  UnitTest::BenchmarkTime <= 0);
+    }
+    else
+    {
+      std::cerr << "Unrecognized option \"" << arg
+                << "\" for test program " << argv[0] << "\n";
+      return 1;
+    }
+    if (badValue)
+    {
+      std::cerr << "Bad value in \"" << arg
+                << "\" for test program " << argv[0] << "\n";
+      return 1;
+    }
+  }
+  UnitTest::InstallCrashHandlers(argc, argv);
+  if (UnitTest::PinThreads && !UnitTest::SetUpPinning(std::cout))
+  {
+    return 1;
+  }
+  if (numaBenchmark)
+  {
+    return UnitTest::RunNumaBenchmark();
+  }
+  UnitTest::RunSeed = UnitTest::Seed;
+  if (UnitTest::RepeatCount != 0 || UnitTest::UntilFail ||
+      UnitTest::StressThreads != 0)
+  {
+    if (tests.empty())
+    {
+      for (UnitTestInfo *t = UnitTest::FirstTest(); t;
+           t = UnitTest::NextTest(t))
+      {
+        tests.push_back(t);
+      }
+    }
+    return UnitTest::RunRepeated(tests);
+  }
+  if (UnitTest::Benchmarking)
+  {
+    // Benchmarks are always timed again, so the cache is not used.
+    UnitTest::UseCache = false;
+    UnitTest::PrintTimer(std::cout);
+    if (UnitTest::PinThreads)
+    {
+      UnitTestPinThread(0);
+    }
+    if (tests.empty())
+    {
+      std::string value;
+      for (UnitTestInfo *t = UnitTest::FirstTest(); t;
+           t = UnitTest::NextTest(t))
+      {
+        if (UnitTest::GetProperty(t, "benchmark", &value))
+        {
+          tests.push_back(t);
+        }
+      }
+    }
+    return UnitTest::RunTests(tests);
+  }
+  // A single test is run on its own, unless its result is to be saved.
+  if (tests.size() == 1 && UnitTest::CacheDirectory == 0 &&
+      !UnitTest::FailedFirst)
+  {
+    return UnitTest::RunTest(test);
+  }
+  else if (!tests.empty())
+  {
+    return UnitTest::RunTests(tests);
+  }
+  return UnitTest::RunAllTests();
+}
+
+// Write the "--resume" argument now, since the signal handler cannot.
+inline void UnitTest::SetResumePoint(
+  size_t next, size_t passed, size_t failed, size_t cached)
+{
+#ifdef UNITTEST_SIGNALS
+  snprintf(UnitTest::ResumeArg, sizeof(UnitTest::ResumeArg),
+           "--resume=%lu,%lu,%lu,%lu,%s", static_cast<unsigned long>(passed),
+           static_cast<unsigned long>(failed),
+           static_cast<unsigned long>(cached),
+           static_cast<unsigned long>(next), UnitTest::ResumeFile.c_str());
+#else
+  (void)next;
+  (void)passed;
+  (void)failed;
+  (void)cached;
+#endif
+}
+
+#ifdef UNITTEST_SIGNALS
+//! Write a string to a file descriptor from within a signal handler.
+inline void UnitTestWriteSignalSafe(int fd, const char *text)
+{
+  size_t n = strlen(text);
+  while (n > 0)
+  {
+    ssize_t m = write(fd, text, n);
+    if (m <= 0)
+    {
+      break;
+    }
+    text += m;
+    n -= m;
+  }
+}
+
+// Run the handlers on their own stack, so that stack overflows are caught.
+// The threads that the framework starts get their own UnitTestSignalStack.
+inline void UnitTest::InstallCrashHandlers(int argc, char *argv[])
+{
+  // The new process gets the same arguments, plus the "--resume" argument.
+  UnitTest::ResumeArgv = new char *[argc + 2];
+  int n = 0;
+  for (int i = 0; i < argc; i++)
+  {
+    if (strncmp(argv[i], "--resume=", 9) != 0)
+    {
+      UnitTest::ResumeArgv[n++] = argv[i];
+    }
+  }
+  UnitTest::ResumeArgv[n++] = UnitTest::ResumeArg;
+  UnitTest::ResumeArgv[n] = 0;
+#ifdef UNITTEST_BACKTRACE
+  // The first backtrace() loads libraries, which is not signal-safe.
+  void *frame;
+  backtrace(&frame, 1);
+#endif
+  static char stack[1 << 17];
+  stack_t ss;
+  ss.ss_sp = stack;
+  ss.ss_size = sizeof(stack);
+  ss.ss_flags = 0;
+  sigaltstack(&ss, 0);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &UnitTest::CrashHandler;
+  action.sa_flags = SA_ONSTACK | SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+  static const int signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+  for (size_t i = 0; i < sizeof(signals)/sizeof(signals[0]); i++)
+  {
+    sigaction(signals[i], &action, 0);
+  }
+}
+
+// Only async-signal-safe functions can be used, since the process might
+// have crashed within malloc() or within the iostreams.
+inline void UnitTest::CrashHandler(int sig)
+{
+  const char *name = "signal";
+  switch (sig)
+  {
+    case SIGSEGV: name = "SIGSEGV"; break;
+    case SIGBUS: name = "SIGBUS"; break;
+    case SIGFPE: name = "SIGFPE"; break;
+    case SIGILL: name = "SIGILL"; break;
+    case SIGABRT: name = "SIGABRT"; break;
+  }
+  // If a list of tests is running, the name of the test has been printed.
+  bool inList = (UnitTest::ResumeArg[0] != '\0');
+  if (inList)
+  {
+    UnitTestWriteSignalSafe(1, "[Crashed]\n");
+  }
+  UnitTestWriteSignalSafe(2, "Crashed with ");
+  UnitTestWriteSignalSafe(2, name);
+  UnitTestInfo *info = UnitTest::CurrentTest;
+  if (info != 0)
+  {
+    char line[24];
+    char *cp = line + sizeof(line);
+    *--cp = '\0';
+    unsigned int value = info->Line;
+    do
+    {
+      *--cp = static_cast<char>('0' + value % 10);
+      value /= 10;
+    }
+    while (value != 0);
+    const char *suite = info->Suite();
+    UnitTestWriteSignalSafe(2, " in ");
+    UnitTestWriteSignalSafe(2, suite);
+    UnitTestWriteSignalSafe(2, (suite[0] == '\0' ? "" : "-"));
+    UnitTestWriteSignalSafe(2, info->Name);
+    UnitTestWriteSignalSafe(2, " ");
+    UnitTestWriteSignalSafe(2, info->File);
+    UnitTestWriteSignalSafe(2, ":");
+    UnitTestWriteSignalSafe(2, cp);
+  }
+  UnitTestWriteSignalSafe(2, " [UnitTest]\n");
+#ifdef UNITTEST_BACKTRACE
+  void *frames[64];
+  int n = backtrace(frames, 64);
+  backtrace_symbols_fd(frames, n, 2);
+#endif
+  if (inList && UnitTest::ResumeOnCrash && UnitTest::ResumeArgv != 0)
+  {
+    // The signal is blocked in the handler, and exec would keep it blocked.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, sig);
+    sigprocmask(SIG_UNBLOCK, &mask, 0);
+#if defined(__linux__)
+    execv("/proc/self/exe", UnitTest::ResumeArgv);
+#endif
+    execv(UnitTest::ResumeArgv[0], UnitTest::ResumeArgv);
+    UnitTestWriteSignalSafe(
+      2, "Could not start a new process for the remaining tests [UnitTest]\n");
+  }
+  // Let the default action terminate the process.
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+#else
+// Crashes cannot be caught on this platform.
+inline void UnitTest::InstallCrashHandlers(int, char *[])
+{
+}
+
+inline void UnitTest::CrashHandler(int)
+{
+}
+#endif
+
+//! Mismatch statistics from an array check.
+struct UnitTestArrayStats
+{
+  size_t Mismatches;
+  size_t First;
+  size_t Columns;
+
+  //! Merge the stats from a chunk that follows this one.
+  void Merge(const UnitTestArrayStats &other)
+  {
+    if (Mismatches == 0)
+    {
+      First = other.First;
+    }
+    Mismatches += other.Mismatches;
+  }
+};
+
+// Print the number of mismatches and the index of the first mismatch.
+inline std::ostream &operator<<(
+  std::ostream &os, const UnitTestArrayStats &stats)
+{
+  os << " with " << stats.Mismatches << " mismatches, first at [";
+  if (stats.Columns == 0)
+  {
+    os << stats.First << "]";
+  }
+  else
+  {
+    os << (stats.First / stats.Columns) << "]["
+       << (stats.First % stats.Columns) << "]";
+  }
+  return os;
+}
+
+//! Element comparison for the CHECK_ARRAY_EQUAL macros.
+struct UnitTestEqual
+{
+  template<class A, class B>
+  bool operator()(const A &a, const B &b) const { return (a == b); }
+};
+
+//! Element comparison for the CHECK_ARRAY_CLOSE macros.
+struct UnitTestClose
+{
+  double Tolerance;
+
+  explicit UnitTestClose(double tol) : Tolerance(tol) {}
+
+  template<class A, class B>
+  bool operator()(const A &a, const B &b) const
+  {
+    return (fabs(a - b) < Tolerance);
+  }
+};
+
+//! Compare the elements [begin, end) of two arrays.  The arrays are not
+//! const, since some types only have a non-const operator[].
+template<class X, class Y, class Compare>
+class UnitTestArrayCompare
+{
+public:
+  UnitTestArrayCompare(X &x, Y &y, Compare c)
+    : ArrayX(x), ArrayY(y), Comparison(c) {}
+
+  //! Compare, the count is branch-free to allow vectorization.
+  void operator()(size_t begin, size_t end, UnitTestArrayStats *stats) const
+  {
+    size_t count = 0;
+    for (size_t i = begin; i < end; i++)
+    {
+      count += !this->Comparison(this->ArrayX[i], this->ArrayY[i]);
+    }
+    stats->Mismatches = count;
+    // Only a failed check pays for a second pass to find the first index.
+    for (size_t i = begin; count > 0; i++)
+    {
+      if (!this->Comparison(this->ArrayX[i], this->ArrayY[i]))
+      {
+        stats->First = i;
+        break;
+      }
+    }
+  }
+
+private:
+  X &ArrayX;
+  Y &ArrayY;
+  Compare Comparison;
+};
+
+//! Compare the rows [begin, end) of two 2D arrays.
+template<class X, class Y, class Compare>
+class UnitTestArray2DCompare
+{
+public:
+  UnitTestArray2DCompare(X &x, Y &y, size_t columns, Compare c)
+    : ArrayX(x), ArrayY(y), Columns(columns), Comparison(c) {}
+
+  //! Compare, the count is branch-free to allow vectorization.
+  void operator()(size_t begin, size_t end, UnitTestArrayStats *stats) const
+  {
+    size_t count = 0;
+    for (size_t i = begin; i < end; i++)
+    {
+      for (size_t j = 0; j < this->Columns; j++)
+      {
+        count += !this->Comparison(this->ArrayX[i][j], this->ArrayY[i][j]);
+      }
+    }
+    stats->Mismatches = count;
+    for (size_t k = begin*this->Columns; count > 0; k++)
+    {
+      size_t i = k/this->Columns;
+      size_t j = k%this->Columns;
+      if (!this->Comparison(this->ArrayX[i][j], this->ArrayY[i][j]))
+      {
+        stats->First = k;
+        break;
+      }
+    }
+  }
+
+private:
+  X &ArrayX;
+  Y &ArrayY;
+  size_t Columns;
+  Compare Comparison;
+};
+
+//! Run a comparison, splitting large arrays into chunks across threads
+//! if the arrays can be shared, i.e. if they are indexed through const.
+template<class Task>
+UnitTestArrayStats UnitTestCompareChunks(
+  const Task &task, size_t rows, size_t columns, bool shared)
+{
+  UnitTestArrayStats stats = { 0, 0, columns };
+#ifdef UNITTEST_THREADS
+  size_t threads = 1;
+  if (shared &&
+      rows*(columns == 0 ? 1 : columns) >= UnitTest::ParallelThreshold)
+  {
+    threads = UnitTest::CountThreads();
+    threads = (threads < rows ? threads : rows);
+  }
+  if (threads > 1)
+  {
+    // The calling thread does the first chunk.  An exception from any
+    // chunk is rethrown only after all of the workers have been joined.
+    std::vector<UnitTestArrayStats> parts(threads, stats);
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+    for (size_t k = 1; k < threads; k++)
+    {
+      workers.push_back(std::thread([&, k]()
+      {
+        UnitTestSignalStack stack;
+        if (UnitTest::PinThreads)
+        {
+          UnitTestPinThread(k);
+        }
+#ifdef UNITTEST_EXCEPTIONS
+        try
+        {
+          task(rows*k/threads, rows*(k + 1)/threads, &parts[k]);
+        }
+        catch (...)
+        {
+          errors[k] = std::current_exception();
+        }
+#else
+        task(rows*k/threads, rows*(k + 1)/threads, &parts[k]);
+#endif
+      }));
+    }
+#ifdef UNITTEST_EXCEPTIONS
+    try
+    {
+      task(0, rows/threads, &parts[0]);
+    }
+    catch (...)
+    {
+      errors[0] = std::current_exception();
+    }
+#else
+    task(0, rows/threads, &parts[0]);
+#endif
+    for (size_t k = 0; k < workers.size(); k++)
+    {
+      workers[k].join();
+    }
+    // Merge in chunk order, so that the result is deterministic.
+    for (size_t k = 0; k < threads; k++)
+    {
+#ifdef UNITTEST_EXCEPTIONS
+      if (errors[k])
+      {
+        std::rethrow_exception(errors[k]);
+      }
+#endif
+      stats.Merge(parts[k]);
+    }
+    return stats;
+  }
+#else
+  (void)shared;
+#endif
+  task(0, rows, &stats);
+  return stats;
+}
+
+#ifdef UNITTEST_CXX11
+//! Whether an array can be indexed through const, and therefore be read by
+//! several threads at once.  A non-const operator[] might insert elements.
+template<class X, class = void>
+struct UnitTestConstIndex : std::false_type {};
+
+template<class X>
+struct UnitTestConstIndex<
+  X, decltype((void)std::declval<const X &>()[0])> : std::true_type {};
+
+//! Whether a 2D array can be indexed through const.
+template<class X, class = void>
+struct UnitTestConstIndex2D : std::false_type {};
+
+template<class X>
+struct UnitTestConstIndex2D<
+  X, decltype((void)std::declval<const X &>()[0][0])> : std::true_type {};
+
+//! Compare two arrays with the given element comparison.  The arrays are
+//! forwarded, so that lvalues keep their constness, and temporaries work.
+//! The arrays are split across threads only if both have a const [].
+template<class X, class Y, class Compare>
+UnitTestArrayStats UnitTestCompareArrays(
+  X &&x, Y &&y, size_t size, Compare c)
+{
+  typedef typename std::remove_reference<X>::type ArrayX;
+  typedef typename std::remove_reference<Y>::type ArrayY;
+  const bool constX = UnitTestConstIndex<ArrayX>::value;
+  const bool constY = UnitTestConstIndex<ArrayY>::value;
+  typedef typename std::conditional<
+    constX, const ArrayX, ArrayX>::type IndexX;
+  typedef typename std::conditional<
+    constY, const ArrayY, ArrayY>::type IndexY;
+  return UnitTestCompareChunks(
+    UnitTestArrayCompare<IndexX, IndexY, Compare>(x, y, c), size, 0,
+    constX && constY);
+}
+
+//! Compare two 2D arrays with the given element comparison.
+template<class X, class Y, class Compare>
+UnitTestArrayStats UnitTestCompareArrays2D(
+  X &&x, Y &&y, size_t sizex, size_t sizey, Compare c)
+{
+  typedef typename std::remove_reference<X>::type ArrayX;
+  typedef typename std::remove_reference<Y>::type ArrayY;
+  const bool constX = UnitTestConstIndex2D<ArrayX>::value;
+  const bool constY = UnitTestConstIndex2D<ArrayY>::value;
+  typedef typename std::conditional<
+    constX, const ArrayX, ArrayX>::type IndexX;
+  typedef typename std::conditional<
+    constY, const ArrayY, ArrayY>::type IndexY;
+  return UnitTestCompareChunks(
+    UnitTestArray2DCompare<IndexX, IndexY, Compare>(x, y, sizey, c),
+    sizex, sizey, constX && constY);
+}
+#else
+//! Compare two arrays with the given element comparison.  If X or Y is
+//! a const type, then it must have a const operator[].
+template<class X, class Y, class Compare>
+UnitTestArrayStats UnitTestCompareArrays(
+  X &x, Y &y, size_t size, Compare c)
+{
+  return UnitTestCompareChunks(
+    UnitTestArrayCompare<X, Y, Compare>(x, y, c), size, 0, false);
+}
+
+//! Compare two arrays, where both can be temporaries.
+template<class X, class Y, class Compare>
+UnitTestArrayStats UnitTestCompareArrays(
+  const X &x, const Y &y, size_t size, Compare c)
+{
+  return UnitTestCompareChunks(
+    UnitTestArrayCompare<const X, const Y, Compare>(x, y, c), size, 0,
+    false);
+}
+
+//! Compare two 2D arrays with the given element comparison.
+template<class X, class Y, class Compare>
+UnitTestArrayStats UnitTestCompareArrays2D(
+  X &x, Y &y, size_t sizex, size_t sizey, Compare c)
+{
+  return UnitTestCompareChunks(
+    UnitTestArray2DCompare<X, Y, Compare>(x, y, sizey, c), sizex, sizey,
+    false);
+}
+
+//! Compare two 2D arrays, where both can be temporaries.
+template<class X, class Y, class Compare>
+UnitTestArrayStats UnitTestCompareArrays2D(
+  const X &x, const Y &y, size_t sizex, size_t sizey, Compare c)
+{
+  return UnitTestCompareChunks(
+    UnitTestArray2DCompare<const X, const Y, Compare>(x, y, sizey, c),
+    sizex, sizey, false);
+}
+#endif
+
+//! The result of comparing two sequences element by element.
+struct UnitTestRangeStats
+{
+  enum ResultType { Equal, Mismatch, FirstShorter, SecondShorter };
+
+  ResultType Result;
+  size_t Position;
+};
+
+// Print where the sequences differ.
+inline std::ostream &operator<<(
+  std::ostream &os, const UnitTestRangeStats &stats)
+{
+  if (stats.Result == UnitTestRangeStats::Mismatch)
+  {
+    os << " with first mismatch at [" << stats.Position << "]";
+  }
+  else if (stats.Result == UnitTestRangeStats::FirstShorter)
+  {
+    os << " with first sequence ending at [" << stats.Position << "]";
+  }
+  else if (stats.Result == UnitTestRangeStats::SecondShorter)
+  {
+    os << " with second sequence ending at [" << stats.Position << "]";
+  }
+  return os;
+}
+
+//! Compare two sequences in a single pass, with input iterators.  The end
+//! of each sequence can be a sentinel with a different type.
+template<class I1, class S1, class I2, class S2, class Compare>
+UnitTestRangeStats UnitTestCompareRanges(
+  I1 first1, S1 last1, I2 first2, S2 last2, Compare c)
+{
+  UnitTestRangeStats stats = { UnitTestRangeStats::Equal, 0 };
+  for (; first1 != last1 && first2 != last2; ++first1, ++first2)
+  {
+    if (!c(*first1, *first2))
+    {
+      stats.Result = UnitTestRangeStats::Mismatch;
+      return stats;
+    }
+    stats.Position++;
+  }
+  if (first1 != last1)
+  {
+    stats.Result = UnitTestRangeStats::SecondShorter;
+  }
+  else if (first2 != last2)
+  {
+    stats.Result = UnitTestRangeStats::FirstShorter;
+  }
+  return stats;
+}
+
+#ifdef UNITTEST_CXX11
+//! Compare two ranges, which can be C arrays, containers, or views such
+//! as std::views::istream that can only be iterated when non-const.
+template<class R1, class R2, class Compare>
+UnitTestRangeStats UnitTestCompareRanges(R1 &&r1, R2 &&r2, Compare c)
+{
+  return UnitTestCompareRanges(
+    std::begin(r1), std::end(r1), std::begin(r2), std::end(r2), c);
+}
+#else
+//! Compare two ranges that provide begin() and end().
+template<class R1, class R2, class Compare>
+UnitTestRangeStats UnitTestCompareRanges(R1 &r1, R2 &r2, Compare c)
+{
+  return UnitTestCompareRanges(r1.begin(), r1.end(), r2.begin(), r2.end(), c);
+}
+
+//! Compare two ranges, where both can be temporaries.
+template<class R1, class R2, class Compare>
+UnitTestRangeStats UnitTestCompareRanges(
+  const R1 &r1, const R2 &r2, Compare c)
+{
+  return UnitTestCompareRanges(r1.begin(), r1.end(), r2.begin(), r2.end(), c);
+}
+#endif
+
+//! A sequential reader that maps a file, or reads it in chunks.
+class UnitTestFileReader
+{
+public:
+  //! The chunk size, which is a multiple of the hexdump row size.
+  enum { ChunkSize = 1 << 20 };
+
+  //! Open a file, it is mapped into memory if it is a regular file.
+  explicit UnitTestFileReader(const std::string &filename);
+
+  //! Read from a memory buffer instead of from a file.
+  UnitTestFileReader(const void *data, size_t size);
+
+  //! Unmap and close the file.
+  ~UnitTestFileReader();
+
+  //! Check whether the file was successfully opened.
+  bool IsOpen() const { return (this->File != 0 || this->Data != 0); }
+
+  //! Get the next chunk, the return value is zero at the end of the file.
+  size_t Next(const unsigned char **data);
+
+private:
+  UnitTestFileReader(const UnitTestFileReader &);
+  void operator=(const UnitTestFileReader &);
+
+  FILE *File;
+  const unsigned char *Data;
+  size_t Size;
+  size_t Position;
+  void *Map;
+  std::vector<unsigned char> Buffer;
+};
+
+// Open a file, and map it if possible.
+inline UnitTestFileReader::UnitTestFileReader(const std::string &filename)
+  : File(0), Data(0), Size(0), Position(0), Map(0)
+{
+  this->File = fopen(filename.c_str(), "rb");
+#ifdef UNITTEST_POSIX
+  struct stat info;
+  if (this->File != 0 && fstat(fileno(this->File), &info) == 0 &&
+      S_ISREG(info.st_mode) && info.st_size > 0)
+  {
+    void *map = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE,
+                     fileno(this->File), 0);
+    if (map != MAP_FAILED)
+    {
+      madvise(map, info.st_size, MADV_SEQUENTIAL);
+      this->Map = map;
+      this->Data = static_cast<const unsigned char *>(map);
+      this->Size = info.st_size;
+    }
+  }
+#endif
+}
+
+// Use a memory buffer as the data.
+inline UnitTestFileReader::UnitTestFileReader(const void *data, size_t size)
+  : File(0), Data(static_cast<const unsigned char *>(data)), Size(size),
+    Position(0), Map(0)
+{
+  static const unsigned char empty = 0;
+  if (this->Data == 0)
+  {
+    this->Data = &empty;
+    this->Size = 0;
+  }
+}
+
+// Release the map and the file.
+inline UnitTestFileReader::~UnitTestFileReader()
+{
+#ifdef UNITTEST_POSIX
+  if (this->Map != 0)
+  {
+    munmap(this->Map, this->Size);
+  }
+#endif
+  if (this->File != 0)
+  {
+    fclose(this->File);
+  }
+}
+
+// Each chunk is full-sized unless it is the last chunk of the file.
+inline size_t UnitTestFileReader::Next(const unsigned char **data)
+{
+  size_t chunk = ChunkSize;
+  size_t n = 0;
+  if (this->Data != 0)
+  {
+    n = this->Size - this->Position;
+    n = (n < chunk ? n : chunk);
+    *data = this->Data + this->Position;
+  }
+  else if (this->File != 0)
+  {
+    // Pipes can return short reads, so read until the chunk is full.
+    this->Buffer.resize(chunk);
+    size_t m = 1;
+    while (n < chunk && m != 0)
+    {
+      m = fread(&this->Buffer[n], 1, chunk - n, this->File);
+      n += m;
+    }
+    *data = &this->Buffer[0];
+  }
+  this->Position += n;
+  return n;
+}
+
+//! The result of comparing two files.
+struct UnitTestFileStats
+{
+  enum ResultType { Equal, Mismatch, FirstShorter, SecondShorter, NoFile };
+  enum { RowSize = 16, WindowSize = 2*RowSize };
+
+  ResultType Result;
+  size_t Offset;
+  std::string Missing;
+  size_t WindowStart;
+  size_t WindowCount[2];
+  unsigned char Window[2][WindowSize];
+
+  UnitTestFileStats() : Result(Equal), Offset(0), WindowStart(0)
+  {
+    WindowCount[0] = WindowCount[1] = 0;
+  }
+};
+
+// Print where the files differ.
+inline std::ostream &operator<<(
+  std::ostream &os, const UnitTestFileStats &stats)
+{
+  if (stats.Result == UnitTestFileStats::Mismatch)
+  {
+    os << " with first difference at byte " << stats.Offset;
+  }
+  else if (stats.Result == UnitTestFileStats::FirstShorter)
+  {
+    os << " with first file ending at byte " << stats.Offset;
+  }
+  else if (stats.Result == UnitTestFileStats::SecondShorter)
+  {
+    os << " with second file ending at byte " << stats.Offset;
+  }
+  else if (stats.Result == UnitTestFileStats::NoFile)
+  {
+    os << " with unreadable file \"" << stats.Missing << "\"";
+  }
+  return os;
+}
+
+//! A manipulator that prints a hexdump of where the files differ.
+struct UnitTestHexDump
+{
+  const UnitTestFileStats *Stats;
+
+  explicit UnitTestHexDump(const UnitTestFileStats &s) : Stats(&s) {}
+};
+
+// Print two hexdump rows from each file, "<" is first and ">" is second.
+inline std::ostream &operator<<(std::ostream &os, const UnitTestHexDump &h)
+{
+  const UnitTestFileStats &stats = *h.Stats;
+  static const char hex[] = "0123456789abcdef";
+  for (size_t row = 0; row < UnitTestFileStats::WindowSize;
+       row += UnitTestFileStats::RowSize)
+  {
+    for (int k = 0; k < 2; k++)
+    {
+      if (row >= stats.WindowCount[k])
+      {
+        continue;
+      }
+      std::string line = (k == 0 ? "  < " : "  > ");
+      std::string text;
+      size_t offset = stats.WindowStart + row;
+      // At least eight digits, and more for offsets past 4 GiB.
+      int shift = static_cast<int>(sizeof(size_t))*8 - 4;
+      while (shift > 28 && ((offset >> shift) & 0xf) == 0)
+      {
+        shift -= 4;
+      }
+      for (; shift >= 0; shift -= 4)
+      {
+        line += hex[(offset >> shift) & 0xf];
+      }
+      line += " ";
+      for (size_t i = row; i < row + UnitTestFileStats::RowSize; i++)
+      {
+        line += " ";
+        if (i < stats.WindowCount[k])
+        {
+          unsigned char c = stats.Window[k][i];
+          line += hex[c >> 4];
+          line += hex[c & 0xf];
+          text += ((c >= 0x20 && c < 0x7f) ? static_cast<char>(c) : '.');
+        }
+        else
+        {
+          line += "  ";
+        }
+      }
+      os << line << "  |" << text << "|\n";
+    }
+  }
+  return os;
+}
+
+//! Compare two readers chunk by chunk, with memcmp() for speed.
+inline UnitTestFileStats UnitTestCompareFiles(
+  UnitTestFileReader *a, UnitTestFileReader *b)
+{
+  UnitTestFileStats stats;
+  UnitTestFileReader *readers[2] = { a, b };
+  for (;;)
+  {
+    const unsigned char *data[2];
+    size_t n[2];
+    for (int k = 0; k < 2; k++)
+    {
+      n[k] = readers[k]->Next(&data[k]);
+    }
+    size_t m = (n[0] < n[1] ? n[0] : n[1]);
+    if (memcmp(data[0], data[1], m) != 0)
+    {
+      size_t i = 0;
+      while (data[0][i] == data[1][i])
+      {
+        i++;
+      }
+      // Chunks are aligned to rows, so the row is within the chunk.
+      size_t row = i - i % UnitTestFileStats::RowSize;
+      size_t window = UnitTestFileStats::WindowSize;
+      stats.Result = UnitTestFileStats::Mismatch;
+      stats.Offset += i;
+      stats.WindowStart = stats.Offset - i + row;
+      for (int k = 0; k < 2; k++)
+      {
+        size_t c = n[k] - row;
+        c = (c < window ? c : window);
+        memcpy(stats.Window[k], data[k] + row, c);
+        stats.WindowCount[k] = c;
+      }
+      return stats;
+    }
+    stats.Offset += m;
+    if (n[0] != n[1])
+    {
+      stats.Result = (n[0] < n[1] ? UnitTestFileStats::FirstShorter :
+                      UnitTestFileStats::SecondShorter);
+      return stats;
+    }
+    if (m == 0)
+    {
+      return stats;
+    }
+  }
+}
+
+//! Compare two files.
+inline UnitTestFileStats UnitTestCompareFiles(
+  const std::string &filename1, const std::string &filename2)
+{
+  UnitTestFileReader a(filename1);
+  UnitTestFileReader b(filename2);
+  UnitTestFileStats stats;
+  if (!a.IsOpen() || !b.IsOpen())
+  {
+    stats.Result = UnitTestFileStats::NoFile;
+    stats.Missing = (a.IsOpen() ? filename2 : filename1);
+    return stats;
+  }
+  return UnitTestCompareFiles(&a, &b);
+}
+
+//! Compare a file to a memory buffer.
+inline UnitTestFileStats UnitTestCompareFiles(
+  const std::string &filename, const void *data, size_t size)
+{
+  UnitTestFileReader a(filename);
+  UnitTestFileReader b(data, size);
+  UnitTestFileStats stats;
+  if (!a.IsOpen())
+  {
+    stats.Result = UnitTestFileStats::NoFile;
+    stats.Missing = filename;
+    return stats;
+  }
+  return UnitTestCompareFiles(&a, &b);
+}
+
+//! Compute a fast 64-bit hash, in four lanes of eight bytes each.
+inline uint64_t UnitTestHash(const void *data, size_t size)
+{
+  const uint64_t k1 = (static_cast<uint64_t>(0x9e3779b9) << 32) | 0x7f4a7c15;
+  const uint64_t k2 = (static_cast<uint64_t>(0xc2b2ae3d) << 32) | 0x27d4eb4f;
+  const unsigned char *cp = static_cast<const unsigned char *>(data);
+  uint64_t h[4] = { k1, k2, ~k1, ~k2 };
+  for (; size >= 32; size -= 32, cp += 32)
+  {
+    // The lanes are independent, so that the multiplies can overlap.
+    for (int i = 0; i < 4; i++)
+    {
+      uint64_t v;
+      memcpy(&v, cp + 8*i, 8);
+      h[i] = (h[i] ^ (v*k2));
+      h[i] = ((h[i] << 31) | (h[i] >> 33))*k1;
+    }
+  }
+  uint64_t x = h[0] ^ (h[1]*3) ^ (h[2]*5) ^ (h[3]*7) ^ size;
+  for (; size > 0; size--, cp++)
+  {
+    x = (x ^ *cp)*k1;
+  }
+  // Finalize so that every input bit affects every output bit.
+  x = (x ^ (x >> 33))*k2;
+  x = (x ^ (x >> 29))*k1;
+  return x ^ (x >> 32);
+}
+
+//! Create the parent directories of the file, as needed.
+inline void UnitTestMakeDirectories(const std::string &filename)
+{
+  for (size_t i = 1; i < filename.length(); i++)
+  {
+    if (filename[i] == '/' || filename[i] == '\\')
+    {
+      std::string dir = filename.substr(0, i);
+#if defined(UNITTEST_POSIX)
+      mkdir(dir.c_str(), 0777);
+#elif defined(_WIN32)
+      _mkdir(dir.c_str());
+#endif
+    }
+  }
+}
+
+//! Write a file atomically, by writing a temporary file and renaming it.
+inline bool UnitTestWriteFile(
+  const std::string &filename, const void *data, size_t size)
+{
+  // The name is unique to the process, and to the call within it, since
+  // threads that repeat a test might write the same file at once.
+  static UnitTestCounter counter(0);
+  std::ostringstream temp;
+  temp << filename << ".tmp";
+#if defined(UNITTEST_POSIX)
+  temp << getpid();
+#elif defined(_WIN32)
+  temp << _getpid();
+#endif
+  temp << "." << counter++;
+  FILE *fp = fopen(temp.str().c_str(), "wb");
+  if (fp == 0)
+  {
+    return false;
+  }
+  bool success = (fwrite(data, 1, size, fp) == size);
+  success &= (fclose(fp) == 0);
+#ifndef UNITTEST_POSIX
+  // Only POSIX rename() replaces the target.
+  remove(filename.c_str());
+#endif
+  if (!success || rename(temp.str().c_str(), filename.c_str()) != 0)
+  {
+    remove(temp.str().c_str());
+    return false;
+  }
+  return true;
+}
+
+//! Compare data to a snapshot, or update the snapshot if requested.
+//! Get the size and the modification time of a file as text, or return
+//! false if the file does not exist.
+inline bool UnitTestFileStamp(const std::string &filename, std::string *stamp)
+{
+  std::ostringstream text;
+#if defined(UNITTEST_POSIX)
+  struct stat info;
+  if (stat(filename.c_str(), &info) != 0)
+  {
+    return false;
+  }
+  text << info.st_size << " " << info.st_mtime;
+#if defined(__linux__)
+  text << "." << info.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+  text << "." << info.st_mtimespec.tv_nsec;
+#endif
+#elif defined(_WIN32)
+  struct _stat64 info;
+  if (_stat64(filename.c_str(), &info) != 0)
+  {
+    return false;
+  }
+  text << info.st_size << " " << info.st_mtime;
+#else
+  // Without a way to check the file, it is always compared.
+  (void)filename;
+  return false;
+#endif
+  *stamp = text.str();
+  return true;
+}
+
+//! Write the ".hash" file for a snapshot that matches the given hash.
+inline bool UnitTestWriteSnapshotHash(
+  const std::string &filename, const std::string &hash)
+{
+  std::string stamp;
+  UnitTestFileStamp(filename, &stamp);
+  std::string text = hash + " " + stamp + "\n";
+  return UnitTestWriteFile(filename + ".hash", text.data(), text.length());
+}
+
+inline UnitTestFileStats UnitTestCompareSnapshot(
+  const std::string &name, const void *data, size_t size)
+{
+  // The ".hash" file holds the hash and size of the data, and the size and
+  // time of the snapshot, so a matching snapshot costs one hash of the data
+  // and one stat() instead of a read of the snapshot.
+  std::string filename =
+    std::string(UnitTest::SnapshotDirectory) + "/" + name;
+  std::string hashname = filename + ".hash";
+  std::ostringstream hashtext;
+  hashtext << std::hex << UnitTestHash(data, size) << std::dec
+           << " " << size;
+  std::string hash = hashtext.str();
+  char stored[128] = "";
+  FILE *fp = fopen(hashname.c_str(), "rb");
+  if (fp != 0)
+  {
+    size_t n = fread(stored, 1, sizeof(stored) - 1, fp);
+    stored[n] = '\0';
+    fclose(fp);
+  }
+  std::string stamp;
+  if (UnitTestFileStamp(filename, &stamp) &&
+      hash + " " + stamp + "\n" == stored)
+  {
+    return UnitTestFileStats();
+  }
+  UnitTestFileStats stats = UnitTestCompareFiles(filename, data, size);
+  if (stats.Result == UnitTestFileStats::Equal)
+  {
+    // The hash is missing or stale, so write it for the next comparison.
+    UnitTestWriteSnapshotHash(filename, hash);
+  }
+  else if (UnitTest::UpdateSnapshots)
+  {
+    UnitTestMakeDirectories(filename);
+    if (UnitTestWriteFile(filename, data, size) &&
+        UnitTestWriteSnapshotHash(filename, hash))
+    {
+      std::cerr << "Updated snapshot \"" << filename << "\" [UnitTest]\n";
+      stats = UnitTestFileStats();
+    }
+  }
+  return stats;
+}
+
+//! Hash a file, return false if the file cannot be read.
+inline bool UnitTestHashFile(const std::string &filename, uint64_t *hash)
+{
+  UnitTestFileReader reader(filename);
+  const unsigned char *data;
+  size_t n;
+  uint64_t h[2] = { 0, 0 };
+  while ((n = reader.Next(&data)) > 0)
+  {
+    h[1] = UnitTestHash(data, n);
+    h[0] = UnitTestHash(h, sizeof(h));
+  }
+  *hash = h[0];
+  return reader.IsOpen();
+}
+
+// The key covers the executable, and the files listed in "inputs".
+inline std::string UnitTest::GetCacheKey(const UnitTestInfo *info)
+{
+  // The executable is only hashed once, it holds the code of every test.
+  static uint64_t executable = 0;
+  static bool hashed = false;
+  if (!hashed)
+  {
+    hashed = true;
+#if defined(__linux__)
+    if (!UnitTestHashFile("/proc/self/exe", &executable))
+#endif
+    if (UnitTest::Executable == 0 ||
+        !UnitTestHashFile(UnitTest::Executable, &executable))
+    {
+      executable = 0;
+    }
+  }
+  if (executable == 0)
+  {
+    return std::string();
+  }
+  std::ostringstream text;
+  text << std::hex << executable;
+  std::string inputs;
+  UnitTest::GetProperty(info, "inputs", &inputs);
+  for (size_t i = 0, j = 0; j < inputs.length(); i = j + 1)
+  {
+    j = inputs.find(',', i);
+    j = (j == std::string::npos ? inputs.length() : j);
+    // A missing input gives a zero hash, so that it cannot match.
+    uint64_t hash = 0;
+    UnitTestHashFile(inputs.substr(i, j - i), &hash);
+    text << " " << hash;
+  }
+  std::string data = text.str();
+  std::ostringstream key;
+  key << std::hex << UnitTestHash(data.data(), data.length());
+  return key.str();
+}
+
+// A state file is a text file with one "value name" line per test.
+inline void UnitTest::ReadStateFile(
+  const std::string &filename, std::map<std::string, std::string> *values)
+{
+  UnitTestFileReader reader(filename);
+  std::string text;
+  const unsigned char *data;
+  size_t n;
+  while ((n = reader.Next(&data)) > 0)
+  {
+    text.append(reinterpret_cast<const char *>(data), n);
+  }
+  for (size_t i = 0, j = 0; j < text.length(); i = j + 1)
+  {
+    j = text.find('\n', i);
+    j = (j == std::string::npos ? text.length() : j);
+    // Later lines replace earlier ones, and an empty value removes a test.
+    size_t k = text.find(' ', i);
+    if (k < j && k > i)
+    {
+      (*values)[text.substr(k + 1, j - k - 1)] = text.substr(i, k - i);
+    }
+    else if (k < j)
+    {
+      values->erase(text.substr(k + 1, j - k - 1));
+    }
+  }
+}
+
+// Read the file again before writing, since other test processes that
+// run at the same time might have updated it.
+inline void UnitTest::UpdateStateFile(
+  const std::string &filename,
+  const std::map<std::string, std::string> &updates)
+{
+  std::map<std::string, std::string> results;
+  UnitTest::ReadStateFile(filename, &results);
+  std::map<std::string, std::string>::const_iterator it;
+  for (it = updates.begin(); it != updates.end(); ++it)
+  {
+    if (it->second.empty())
+    {
+      results.erase(it->first);
+    }
+    else
+    {
+      results[it->first] = it->second;
+    }
+  }
+  std::string text;
+  for (it = results.begin(); it != results.end(); ++it)
+  {
+    text += it->second + " " + it->first + "\n";
+  }
+  UnitTestMakeDirectories(filename);
+  if (!UnitTestWriteFile(filename, text.data(), text.length()))
+  {
+    std::cerr << "Could not write \"" << filename << "\" [UnitTest]\n";
+  }
+}
+
+// The lines are written with a single call, in append mode, so that the
+// lines from other processes are not mixed with them.
+inline void UnitTest::AppendStateFile(
+  const std::string &filename,
+  const std::map<std::string, std::string> &updates)
+{
+  std::string text;
+  std::map<std::string, std::string>::const_iterator it;
+  for (it = updates.begin(); it != updates.end(); ++it)
+  {
+    text += it->second + " " + it->first + "\n";
+  }
+  UnitTestMakeDirectories(filename);
+  FILE *fp = fopen(filename.c_str(), "ab");
+  if (fp == 0 || fwrite(text.data(), 1, text.length(), fp) != text.length())
+  {
+    std::cerr << "Could not write \"" << filename << "\" [UnitTest]\n";
+  }
+  if (fp != 0)
+  {
+    fclose(fp);
+  }
+}
+
+// The file is in the temporary directory, and is named after the process,
+// which keeps its id when it is replaced with a new one after a crash.
+inline void UnitTest::WriteResumeFile(
+  const std::vector<UnitTestInfo *> &tests)
+{
+#ifdef UNITTEST_SIGNALS
+  if (!UnitTest::ResumeOnCrash)
+  {
+    return;
+  }
+  const char *directory = getenv("TMPDIR");
+  std::ostringstream filename;
+  filename << (directory != 0 && *directory ? directory : "/tmp")
+           << "/unittest_resume_" << getpid();
+  std::string text;
+  for (size_t i = 0; i < tests.size(); i++)
+  {
+    text += UnitTestFullName(tests[i]) + "\n";
+  }
+  UnitTest::ResumeFile = filename.str();
+  if (UnitTest::ResumeFile.length() + 64 > sizeof(UnitTest::ResumeArg) ||
+      !UnitTestWriteFile(UnitTest::ResumeFile, text.data(), text.length()))
+  {
+    std::cerr << "Could not write \"" << UnitTest::ResumeFile
+              << "\", a crash will end the run [UnitTest]\n";
+    UnitTest::ResumeFile.clear();
+    UnitTest::ResumeOnCrash = false;
+  }
+#else
+  (void)tests;
+#endif
+}
+
+// The names are one per line.
+inline bool UnitTest::ReadResumeFile(
+  const std::string &filename, std::vector<std::string> *names)
+{
+  UnitTestFileReader reader(filename);
+  std::string text;
+  const unsigned char *data;
+  size_t n;
+  while ((n = reader.Next(&data)) > 0)
+  {
+    text.append(reinterpret_cast<const char *>(data), n);
+  }
+  for (size_t i = 0, j = 0; j < text.length(); i = j + 1)
+  {
+    j = text.find('\n', i);
+    j = (j == std::string::npos ? text.length() : j);
+    names->push_back(text.substr(i, j - i));
+  }
+  return !names->empty();
+}
+
+//! Construct a fixture just before its test runs, and destroy it after.
+template<class T>
+class UnitTestFixtureRunner
+{
+public:
+  //! The fixture is on the heap, since it might be too large for the stack.
+  UnitTestFixtureRunner() : Fixture(new T) {}
+
+  //! Destroy the fixture.
+  ~UnitTestFixtureRunner() { delete this->Fixture; }
+
+  //! Run the test body.
+  void Run() { (*this->Fixture)(); }
+
+private:
+  UnitTestFixtureRunner(const UnitTestFixtureRunner &);
+  void operator=(const UnitTestFixtureRunner &);
+
+  T *Fixture;
+};
+
+#ifdef UNITTEST_THREADS
+//! The lock that guards the setup and teardown of suite fixtures.
+inline std::mutex &UnitTestFixtureMutex()
+{
+  static std::mutex mutex;
+  return mutex;
+}
+#endif
+
+// Tear down the fixtures for the suite, in the reverse order of setup.
+inline void UnitTest::TearDownSuiteFixtures(const char *suite)
+{
+#ifdef UNITTEST_THREADS
+  std::lock_guard<std::mutex> lock(UnitTestFixtureMutex());
+#endif
+  UnitTestSuiteFixture **link = &UnitTest::SuiteFixtures;
+  while (*link != 0)
+  {
+    UnitTestSuiteFixture *fixture = *link;
+    if (suite == 0 || strcmp(suite, fixture->Suite) == 0)
+    {
+      *link = fixture->Next;
+      fixture->TearDown();
+      delete fixture;
+    }
+    else
+    {
+      link = &fixture->Next;
+    }
+  }
+}
+
+//! A read-only fixture that is shared by the tests in a suite.
+template<class T, class Tag>
+class UnitTestSharedFixture
+{
+public:
+  //! Get the fixture, it is set up when it is first used.
+  static const T &Get(const char *suite);
+
+private:
+  static void TearDown();
+
+#ifdef UNITTEST_THREADS
+  static std::atomic<T *> Instance;
+#else
+  static T *Instance;
+#endif
+};
+
+#ifdef UNITTEST_THREADS
+template<class T, class Tag>
+std::atomic<T *> UnitTestSharedFixture<T, Tag>::Instance(0);
+
+// Set up the fixture once, even if tests are run concurrently.
+template<class T, class Tag>
+const T &UnitTestSharedFixture<T, Tag>::Get(const char *suite)
+{
+  T *fixture = Instance.load(std::memory_order_acquire);
+  if (fixture == 0)
+  {
+    std::lock_guard<std::mutex> lock(UnitTestFixtureMutex());
+    fixture = Instance.load(std::memory_order_relaxed);
+    if (fixture == 0)
+    {
+      double t = UnitTest::GetTime();
+      fixture = new T;
+      UnitTest::AddSuiteFixture(suite, &TearDown, UnitTest::GetTime() - t);
+      Instance.store(fixture, std::memory_order_release);
+    }
+  }
+  return *fixture;
+}
+
+// This is called by TearDownSuiteFixtures() with the fixture lock held.
+template<class T, class Tag>
+void UnitTestSharedFixture<T, Tag>::TearDown()
+{
+  delete Instance.exchange(0);
+}
+#else
+template<class T, class Tag>
+T *UnitTestSharedFixture<T, Tag>::Instance = 0;
+
+// Set up the fixture once.
+template<class T, class Tag>
+const T &UnitTestSharedFixture<T, Tag>::Get(const char *suite)
+{
+  if (Instance == 0)
+  {
+    double t = UnitTest::GetTime();
+    Instance = new T;
+    UnitTest::AddSuiteFixture(suite, &TearDown, UnitTest::GetTime() - t);
+  }
+  return *Instance;
+}
+
+// This is called by TearDownSuiteFixtures().
+template<class T, class Tag>
+void UnitTestSharedFixture<T, Tag>::TearDown()
+{
+  delete Instance;
+  Instance = 0;
+}
+#endif
+
+#ifdef UNITTEST_THREADS
+//! The timing of each thread from UNITTEST_CONCURRENTLY().
+struct UnitTestConcurrencyStats
+{
+  unsigned long Iterations;
+  std::vector<double> Seconds;
+
+  //! The total number of iterations per second, over all of the threads
+  //! that took a measurable time.
+  double Throughput() const
+  {
+    double total = 0.0;
+    for (size_t k = 0; k < this->Seconds.size(); k++)
+    {
+      if (this->Seconds[k] > 0.0)
+      {
+        total += this->Iterations/this->Seconds[k];
+      }
+    }
+    return total;
+  }
+
+  //! The difference between the fastest and slowest threads, as a fraction,
+  //! or zero if there were no threads.
+  double Spread() const
+  {
+    if (this->Seconds.empty())
+    {
+      return 0.0;
+    }
+    double slowest = *std::max_element(this->Seconds.begin(),
+                                       this->Seconds.end());
+    double fastest = *std::min_element(this->Seconds.begin(),
+                                       this->Seconds.end());
+    return (slowest > 0.0 ? (slowest - fastest)/slowest : 0.0);
+  }
+};
+
+//! Print the thread count, the throughput, and the spread.
+inline std::ostream &operator<<(
+  std::ostream &os, const UnitTestConcurrencyStats &stats)
+{
+  os << stats.Seconds.size() << " threads, "
+     << static_cast<unsigned long>(stats.Throughput()) << " iterations/s, "
+     << static_cast<int>(stats.Spread()*100.0 + 0.5) << "% spread";
+  return os;
+}
+
+//! Run a function on several threads at once, see UNITTEST_CONCURRENTLY().
+template<class Function>
+UnitTestConcurrencyStats UnitTestConcurrently(
+  size_t threads, unsigned long iterations, Function function, bool pin,
+  const char *file, int line)
+{
+  UnitTestConcurrencyStats stats;
+  stats.Iterations = iterations;
+  stats.Seconds.resize(threads, 0.0);
+  UnitTestBarrier barrier(threads);
+  uint64_t yieldState = UnitTest::YieldState;
+  std::vector<std::thread> workers;
+  for (size_t k = 0; k < threads; k++)
   {
-    suite = test;
-    suiteLen = cp - test;
+    workers.push_back(std::thread([&, k]()
+    {
+      UnitTestSignalStack stack;
+      UnitTest::YieldState = UnitTestMix(yieldState + k + 1);
+      if (pin || UnitTest::PinThreads)
+      {
+        UnitTestPinThread(k);
+      }
+      // The clock starts when the barrier releases all of the threads.
+      barrier.Wait();
+      std::ostringstream where;
+      where << " on thread " << (k + 1);
+      double start = UnitTest::GetTime();
+      UnitTestContainExceptions([&]()
+      {
+        for (unsigned long i = 0; i < iterations; i++)
+        {
+          function(k);
+        }
+      }, where.str(), file, line);
+      stats.Seconds[k] = UnitTest::GetTime() - start;
+    }));
   }
-  // The 'stest' is the remainder, after the hyphen.
-  const char *stest = test + suiteLen + (suiteLen > 0 ? 1 : 0);
-  UnitTest::TestFailed = false;
-  for (size_t i = 0; i < UnitTest::Tests->size(); i++)
+  for (size_t k = 0; k < threads; k++)
   {
-    UnitTest *t = UnitTest::Tests->at(i);
-    // First check that the suite name matches.
-    const char *tsuite = t->GetSuiteName();
-    if ((suiteLen == 0 && *tsuite == '\0') ||
-        (suiteLen > 0 && strncmp(tsuite, suite, suiteLen) == 0 &&
-         tsuite[suiteLen] == '\0'))
+    workers[k].join();
+  }
+  std::ostringstream note;
+  note << stats;
+  UnitTest::AddNote(note.str());
+  return stats;
+}
+#endif
+
+#if defined(__GNUC__)
+//! Make the compiler assume that a value is used, so that the code that
+//! computes it is not removed.
+template<class T>
+inline void UnitTestDoNotOptimize(const T &value)
+{
+  __asm__ __volatile__("" : : "r,m"(value) : "memory");
+}
+
+//! Make the compiler assume that a value is used and then modified.
+template<class T>
+inline void UnitTestDoNotOptimize(T &value)
+{
+#if defined(__clang__)
+  __asm__ __volatile__("" : "+r,m"(value) : : "memory");
+#else
+  __asm__ __volatile__("" : "+m,r"(value) : : "memory");
+#endif
+}
+
+//! Make the compiler assume that all memory is read and written here.
+inline void UnitTestClobberMemory()
+{
+  __asm__ __volatile__("" : : : "memory");
+}
+#else
+//! Make the compiler assume that a value is used, by storing its address.
+template<class T>
+inline void UnitTestDoNotOptimize(const T &value)
+{
+  static const void *volatile sink;
+  sink = &value;
+#ifdef UNITTEST_THREADS
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+//! Make the compiler assume that all memory is read and written here.
+inline void UnitTestClobberMemory()
+{
+#ifdef UNITTEST_THREADS
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+#endif
+
+//! The base class for benchmarks, which runs the timing loop.
+class UnitTestBenchmark
+{
+public:
+  UnitTestBenchmark()
+    : Batch(0), Remaining(0), Pauses(0), BatchStart(0.0), Start(0.0),
+      Elapsed(0.0) {}
+
+  //! Call this in a loop around the code that is being timed.  Unless the
+  //! program is run with "--benchmark", the loop runs only once.
+  bool KeepRunning()
+  {
+    if (this->Remaining != 0)
     {
-      // Check that the test name maches.
-      if (strcmp(t->GetTestName(), stest) == 0)
+      this->Remaining--;
+      return true;
+    }
+    return this->NextBatch();
+  }
+
+  //! Stop the clock, for work within the loop that should not be timed.
+  void PauseTiming()
+  {
+    this->Elapsed += UnitTest::GetTime() - this->Start;
+    this->Pauses++;
+  }
+
+  //! Restart the clock after PauseTiming().
+  void ResumeTiming()
+  {
+    this->Start = UnitTest::GetTime();
+  }
+
+  //! Measure the time that a pause adds to the timed part of the loop,
+  //! which is mostly the time for one reading of the clock.
+  static double MeasurePause();
+
+private:
+  //! Finish a batch of iterations, and decide whether to run another.
+  bool NextBatch();
+
+  unsigned long Batch;
+  unsigned long Remaining;
+  unsigned long Pauses;
+  double BatchStart;
+  double Start;
+  double Elapsed;
+};
+
+// Time many empty pauses, and keep the fastest of several tries.
+inline double UnitTestBenchmark::MeasurePause()
+{
+  const int n = 1000;
+  double best = 0.0;
+  for (int k = 0; k < 10; k++)
+  {
+    UnitTestBenchmark b;
+    b.ResumeTiming();
+    for (int i = 0; i < n; i++)
+    {
+      b.PauseTiming();
+      b.ResumeTiming();
+    }
+    b.PauseTiming();
+    double t = b.Elapsed/(n + 1);
+    best = (k == 0 || t < best ? t : best);
+  }
+  return best;
+}
+
+// This is called once by CalibrateTimer(), before any benchmark can read
+// the value.
+inline void UnitTest::CalibratePause()
+{
+  UnitTest::PauseOverhead = UnitTestBenchmark::MeasurePause();
+}
+
+// Each batch starts over with more iterations, until a batch takes at
+// least BenchmarkTime, and only the time of that batch is reported.  If
+// most of the time is paused, then the total time of the batch is limited.
+inline bool UnitTestBenchmark::NextBatch()
+{
+  double now = UnitTest::GetTime();
+  if (this->Batch != 0)
+  {
+    double elapsed = this->Elapsed + (now - this->Start);
+    double total = now - this->BatchStart;
+    double limit = 5*UnitTest::BenchmarkTime;
+    if (this->Pauses != 0)
+    {
+      elapsed -= this->Pauses*UnitTest::PauseOverhead;
+      elapsed = (elapsed > 0.0 ? elapsed : 0.0);
+    }
+    if (!UnitTest::Benchmarking || elapsed >= UnitTest::BenchmarkTime ||
+        total >= limit || this->Batch >= 1000000000ul)
+    {
+      if (UnitTest::Benchmarking)
       {
-        (*t)();
-        return UnitTest::TestFailed;
+        std::ostringstream note;
+        note << (elapsed*1e9/this->Batch) << " ns/iteration, "
+             << this->Batch << " iterations";
+        UnitTest::AddNote(note.str());
       }
+      return false;
     }
+    // Aim for a little more than the minimum time, in one more batch.
+    double scale = 1.4*UnitTest::BenchmarkTime/elapsed;
+    scale = (elapsed > 0.0 && scale < 10.0 ? scale : 10.0);
+    scale = (scale > 2.0 ? scale : 2.0);
+    scale = std::min(scale, 1.4*limit/total);
+    this->Batch = static_cast<unsigned long>(this->Batch*scale) + 1;
   }
-  std::cerr << "Unknown test \"" << test << "\" for file " << __FILE__ << "\n";
-  return 1;
+  else
+  {
+    this->Batch = 1;
+  }
+  // This call counts as the first iteration of the batch.
+  this->Remaining = this->Batch - 1;
+  this->Pauses = 0;
+  this->Elapsed = 0.0;
+  this->BatchStart = UnitTest::GetTime();
+  this->Start = this->BatchStart;
+  return true;
 }
 
-// Run all of the tests in the list.
-inline int UnitTest::RunAllTests()
+//! Fail the test if the scope takes longer than a time limit.
+class UnitTestTimeConstraint
 {
-  bool anyFailed = false;
-  for (size_t i = 0; i < UnitTest::Tests->size(); i++)
-  {
-    UnitTest::TestFailed = false;
-    UnitTest *t = UnitTest::Tests->at(i);
-    const char *suite = t->GetSuiteName();
-    const char *name = t->GetTestName();
-    std::cout << suite << (suite[0] == 0 ? "" : "-") << name << ": ";
-    std::cout.flush();
-    (*t)();
-    std::cout << (UnitTest::TestFailed ? "[Failed]" : "[Passed]")
-              << std::endl;
-    anyFailed |= UnitTest::TestFailed;
+public:
+  UnitTestTimeConstraint(double milliseconds, UnitTestSite *site)
+    : Limit(milliseconds), Site(site), Start(UnitTest::GetTime()) {}
+
+  //! Check the time when the scope ends.
+  ~UnitTestTimeConstraint()
+  {
+    double elapsed = (UnitTest::GetTime() - this->Start)*1000.0;
+    if (elapsed > this->Limit && UnitTest::CountFailure(this->Site))
+    {
+      std::ostringstream message;
+      message << "Failed time constraint, took " << elapsed
+              << " ms, the limit is " << this->Limit << " ms "
+              << this->Site->File << ":" << this->Site->Line
+              << " [UnitTest]\n";
+      UnitTest::PrintFailure(message.str());
+    }
   }
-  UnitTest::TestFailed = anyFailed;
-  return UnitTest::TestFailed;
+
+private:
+  UnitTestTimeConstraint(const UnitTestTimeConstraint &);
+  void operator=(const UnitTestTimeConstraint &);
+
+  double Limit;
+  UnitTestSite *Site;
+  double Start;
+};
+
+//! A recorder for the history of operations on a concurrent object.
+//! The Model is a sequential version of the object, which provides the
+//! types Operation and Result, a method "Result Apply(const Operation &)",
+//! and an operator<() so that the search can remember the states it has
+//! seen.  Operations and results must be printable with operator<<().
+template<class Model>
+class UnitTestHistory
+{
+public:
+  typedef typename Model::Operation Operation;
+  typedef typename Model::Result Result;
+
+  //! An operation, with the logical times of its call and its return.
+  struct Event
+  {
+    size_t Thread;
+    Operation Op;
+    Result Value;
+    unsigned long Call;
+    unsigned long Return;
+  };
+
+  //! Create a history for the given number of threads.
+  explicit UnitTestHistory(size_t threads) : Threads(threads), Clock(1) {}
+
+  //! Record the call of an operation, before it is performed.
+  void Invoke(size_t thread, const Operation &op)
+  {
+    Event event;
+    event.Thread = thread;
+    event.Op = op;
+    event.Value = Result();
+    event.Call = this->Clock++;
+    event.Return = 0;
+    this->Threads[thread].push_back(event);
+  }
+
+  //! Record the result of the thread's operation, after it is performed.
+  void Respond(size_t thread, const Result &result)
+  {
+    Event &event = this->Threads[thread].back();
+    event.Value = result;
+    event.Return = this->Clock++;
+  }
+
+  //! Get the completed operations, call this after the threads are done.
+  std::vector<Event> GetEvents() const
+  {
+    std::vector<Event> events;
+    for (size_t k = 0; k < this->Threads.size(); k++)
+    {
+      for (size_t i = 0; i < this->Threads[k].size(); i++)
+      {
+        if (this->Threads[k][i].Return != 0)
+        {
+          events.push_back(this->Threads[k][i]);
+        }
+      }
+    }
+    return events;
+  }
+
+private:
+  UnitTestHistory(const UnitTestHistory &);
+  void operator=(const UnitTestHistory &);
+
+  // Each thread only appends to its own list, so no lock is needed.
+  std::vector<std::vector<Event> > Threads;
+  UnitTestCounter Clock;
+};
+
+//! A call or a return in a history, for the linearizability search.
+struct UnitTestHistoryEntry
+{
+  unsigned long Time;
+  size_t Event;
+  bool Call;
+
+  bool operator<(const UnitTestHistoryEntry &other) const
+  {
+    return (this->Time < other.Time);
+  }
+};
+
+//! Check whether a history can be explained by some sequential order of
+//! its operations that respects their real-time order (Wing and Gong's
+//! search, with the memoization of Lowe's algorithm).
+template<class Model>
+bool UnitTestIsLinearizable(
+  const Model &initial,
+  const std::vector<typename UnitTestHistory<Model>::Event> &events)
+{
+  // The entries form a list with a head at 0 and a tail at n + 1, and an
+  // operation is removed from the list (with its return) when it has been
+  // linearized, and restored when the search backtracks.
+  size_t n = 2*events.size();
+  std::vector<UnitTestHistoryEntry> entries(n + 2);
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    UnitTestHistoryEntry call = { events[i].Call, i, true };
+    UnitTestHistoryEntry ret = { events[i].Return, i, false };
+    entries[2*i + 1] = call;
+    entries[2*i + 2] = ret;
+  }
+  std::sort(entries.begin() + 1, entries.end() - 1);
+  std::vector<size_t> next(n + 2);
+  std::vector<size_t> prev(n + 2);
+  std::vector<size_t> match(n + 2);
+  std::vector<size_t> callOf(events.size());
+  for (size_t i = 0; i < n + 2; i++)
+  {
+    next[i] = i + 1;
+    prev[i] = (i > 0 ? i - 1 : 0);
+  }
+  for (size_t i = 1; i <= n; i++)
+  {
+    if (entries[i].Call)
+    {
+      callOf[entries[i].Event] = i;
+    }
+    else
+    {
+      match[callOf[entries[i].Event]] = i;
+    }
+  }
+  Model state = initial;
+  std::vector<uint64_t> linearized((events.size() + 63)/64, 0);
+  std::set<std::pair<std::vector<uint64_t>, Model> > seen;
+  std::vector<std::pair<size_t, Model> > stack;
+  size_t e = next[0];
+  while (next[0] != n + 1)
+  {
+    if (entries[e].Call)
+    {
+      size_t k = entries[e].Event;
+      uint64_t bit = static_cast<uint64_t>(1) << (k % 64);
+      Model after = state;
+      if (after.Apply(events[k].Op) == events[k].Value)
+      {
+        linearized[k/64] |= bit;
+        if (seen.insert(std::make_pair(linearized, after)).second)
+        {
+          // Linearize the operation here, and restart from the head.
+          stack.push_back(std::make_pair(e, state));
+          state = after;
+          size_t r = match[e];
+          next[prev[e]] = next[e];
+          prev[next[e]] = prev[e];
+          next[prev[r]] = next[r];
+          prev[next[r]] = prev[r];
+          e = next[0];
+          continue;
+        }
+        linearized[k/64] &= ~bit;
+      }
+      e = next[e];
+    }
+    else
+    {
+      // A return was reached, so backtrack to the last linearized call.
+      if (stack.empty())
+      {
+        return false;
+      }
+      e = stack.back().first;
+      state = stack.back().second;
+      stack.pop_back();
+      size_t k = entries[e].Event;
+      linearized[k/64] &= ~(static_cast<uint64_t>(1) << (k % 64));
+      size_t r = match[e];
+      next[prev[r]] = r;
+      prev[next[r]] = r;
+      next[prev[e]] = e;
+      prev[next[e]] = e;
+      e = next[e];
+    }
+  }
+  return true;
 }
 
-// List the tests to stdout.
-inline void UnitTest::ListAllTests()
+//! Order events by the time of their call.
+template<class Event>
+bool UnitTestCallsBefore(const Event &a, const Event &b)
+{
+  return (a.Call < b.Call);
+}
+
+//! Find the shortest prefix of a history that is not linearizable, so that
+//! the report ends at the operation where things went wrong.  The history
+//! is only cut where every operation that is left out was called after all
+//! of the kept operations returned, since an operation that overlaps the
+//! kept ones might be what explains their results.  Removing operations
+//! from the middle would be shorter, but could blame an operation whose
+//! result was explained by an operation that was removed.
+template<class Model>
+std::vector<typename UnitTestHistory<Model>::Event> UnitTestMinimizeHistory(
+  const Model &initial,
+  std::vector<typename UnitTestHistory<Model>::Event> events)
+{
+  typedef typename UnitTestHistory<Model>::Event Event;
+  std::sort(events.begin(), events.end(), UnitTestCallsBefore<Event>);
+  unsigned long lastReturn = 0;
+  for (size_t n = 1; n < events.size(); n++)
+  {
+    lastReturn = std::max(lastReturn, events[n - 1].Return);
+    if (lastReturn < events[n].Call)
+    {
+      std::vector<Event> prefix(events.begin(), events.begin() + n);
+      if (!UnitTestIsLinearizable(initial, prefix))
+      {
+        return prefix;
+      }
+    }
+  }
+  return events;
+}
+
+//! Check many histories, on several threads if possible, and return a
+//! description of the smallest failure, or an empty string on success.
+template<class Model>
+std::string UnitTestCheckLinearizable(
+  const Model &initial,
+  const std::vector<std::vector<typename UnitTestHistory<Model>::Event> >
+    &histories)
 {
-  for (size_t i = 0; i < UnitTest::Tests->size(); i++)
+  typedef typename UnitTestHistory<Model>::Event Event;
+  std::vector<char> ok(histories.size(), 1);
+#ifdef UNITTEST_THREADS
+  UnitTestCounter nextHistory(0);
+  size_t threads = UnitTest::CountThreads();
+  threads = (threads < histories.size() ? threads : histories.size());
+  std::vector<std::thread> workers;
+  for (size_t k = 0; k < threads; k++)
+  {
+    workers.push_back(std::thread([&]()
+    {
+      UnitTestSignalStack stack;
+      for (size_t i = nextHistory++; i < histories.size();
+           i = nextHistory++)
+      {
+        ok[i] = UnitTestIsLinearizable(initial, histories[i]);
+      }
+    }));
+  }
+  for (size_t k = 0; k < workers.size(); k++)
+  {
+    workers[k].join();
+  }
+#else
+  for (size_t i = 0; i < histories.size(); i++)
+  {
+    ok[i] = UnitTestIsLinearizable(initial, histories[i]);
+  }
+#endif
+  size_t failures = std::count(ok.begin(), ok.end(), 0);
+  if (failures == 0)
   {
-    UnitTest *t = UnitTest::Tests->at(i);
-    const char *suite = t->GetSuiteName();
-    const char *name = t->GetTestName();
-    std::cout << suite << (suite[0] == 0 ? "" : "-") << name << "\n";
+    return std::string();
   }
+  size_t first = std::find(ok.begin(), ok.end(), 0) - ok.begin();
+  std::vector<Event> events =
+    UnitTestMinimizeHistory(initial, histories[first]);
+  std::ostringstream text;
+  text << failures << " of " << histories.size()
+       << " histories are not linearizable, the first one fails at:\n";
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    text << "  thread " << (events[i].Thread + 1) << " ["
+         << events[i].Call << ", " << events[i].Return << "] "
+         << events[i].Op << " -> " << events[i].Value << "\n";
+  }
+  return text.str();
+}
+
+//! Check a single history.
+template<class Model>
+std::string UnitTestCheckLinearizable(
+  const Model &initial, const UnitTestHistory<Model> &history)
+{
+  return UnitTestCheckLinearizable(initial,
+    std::vector<std::vector<typename UnitTestHistory<Model>::Event> >(
+      1, history.GetEvents()));
 }
 
 namespace SuiteNamespace{
@@ -293,15 +4825,22 @@ namespace SuiteNamespace{
 inline const char *GetSuiteName() { return ""; }
 }
 
-#define CHECK_WITH_MESSAGE(t, m) \
+#define CHECK_WITH_DETAILS(t, m, d) \
 if (!(t)) \
 { \
-  std::cerr << "Failed " << m << " " \
-            << __FILE__ << ":" << __LINE__ << " [UnitTest]\n"; \
-  std::cerr.flush(); \
-  UnitTest::TestFailed = true; \
+  static UnitTestSite unitTestSite = { __FILE__, __LINE__, 0, 0 }; \
+  if (UnitTest::CountFailure(&unitTestSite)) \
+  { \
+    std::ostringstream unitTestMessage; \
+    unitTestMessage << "Failed " << m << " " \
+                    << __FILE__ << ":" << __LINE__ << " [UnitTest]\n" << d; \
+    UnitTest::PrintFailure(unitTestMessage.str()); \
+  } \
 }
 
+#define CHECK_WITH_MESSAGE(t, m) \
+CHECK_WITH_DETAILS(t, m, "")
+
 //! A macro that checks a boolean, the test fails if value is false.
 #define CHECK(t) \
 CHECK_WITH_MESSAGE(t, "CHECK(" #t ")")
@@ -314,32 +4853,20 @@ CHECK_WITH_MESSAGE((expected) == (actual), \
 //! A macro that causes the test to fail unless the arrays are equal.
 #define CHECK_ARRAY_EQUAL(x, y, size) \
 { \
-  size_t array_size = (size); \
-  bool equal_check = true; \
-  for (size_t array_index = 0; array_index < array_size; array_index++) \
-  { \
-    equal_check &= ((x)[array_index] == (y)[array_index]); \
-  } \
-  CHECK_WITH_MESSAGE(equal_check, \
-    "CHECK_ARRAY_EQUAL(" #x ", " #y ", " #size ")") \
+  UnitTestArrayStats array_stats = \
+    UnitTestCompareArrays((x), (y), (size), UnitTestEqual()); \
+  CHECK_WITH_MESSAGE(array_stats.Mismatches == 0, \
+    "CHECK_ARRAY_EQUAL(" #x ", " #y ", " #size ")" << array_stats) \
 }
 
 //! A macro that causes the test to fail unless the arrays are equal.
 #define CHECK_ARRAY2D_EQUAL(x, y, sizex, sizey) \
 { \
-  size_t array_sizex = (sizex); \
-  size_t array_sizey = (sizey); \
-  bool equal_check = true; \
-  for (size_t array_idx = 0; array_idx < array_sizex; array_idx++) \
-  { \
-    for (size_t array_idy = 0; array_idy < array_sizey; array_idy++) \
-    { \
-      equal_check &= ((x)[array_idx][array_idy] == \
-        (y)[array_idx][array_idy]); \
-    } \
-  } \
-  CHECK_WITH_MESSAGE(equal_check, \
-    "CHECK_ARRAY2D_EQUAL(" #x ", " #y ", " #sizex ", " #sizey ")") \
+  UnitTestArrayStats array_stats = \
+    UnitTestCompareArrays2D((x), (y), (sizex), (sizey), UnitTestEqual()); \
+  CHECK_WITH_MESSAGE(array_stats.Mismatches == 0, \
+    "CHECK_ARRAY2D_EQUAL(" #x ", " #y ", " #sizex ", " #sizey ")" \
+    << array_stats) \
 }
 
 //! A macro that causes the test to fail unless the values are close.
@@ -350,36 +4877,187 @@ CHECK_WITH_MESSAGE(fabs((x) - (y)) < (tol), \
 //! A macro that causes the test to fail unless the arrays are close.
 #define CHECK_ARRAY_CLOSE(x, y, size, tol) \
 { \
-  double check_tolerance = (tol); \
-  size_t array_size = (size); \
-  bool equal_check = true; \
-  for (size_t array_index = 0; array_index < array_size; array_index++) \
-  { \
-    equal_check &= (fabs((x)[array_index] - \
-      (y)[array_index]) < check_tolerance); \
-  } \
-  CHECK_WITH_MESSAGE(equal_check, \
-    "CHECK_ARRAY_CLOSE(" #x ", " #y ", " #size ", " #tol ")") \
+  UnitTestArrayStats array_stats = \
+    UnitTestCompareArrays((x), (y), (size), UnitTestClose(tol)); \
+  CHECK_WITH_MESSAGE(array_stats.Mismatches == 0, \
+    "CHECK_ARRAY_CLOSE(" #x ", " #y ", " #size ", " #tol ")" \
+    << array_stats) \
 }
 
 //! A macro that causes the test to fail unless the arrays are close.
 #define CHECK_ARRAY2D_CLOSE(x, y, sizex, sizey, tol) \
 { \
-  double check_tolerance = (tol); \
-  size_t array_sizex = (sizex); \
-  size_t array_sizey = (sizey); \
-  bool equal_check = true; \
-  for (size_t array_idx = 0; array_idx < array_sizex; array_idx++) \
-  { \
-    for (size_t array_idy = 0; array_idy < array_sizey; array_idy++) \
-    { \
-      equal_check &= (fabs((x)[array_idx][array_idy] - \
-            (y)[array_idx][array_idy]) < check_tolerance); \
-    } \
-  } \
-  CHECK_WITH_MESSAGE(equal_check, \
-    "CHECK_ARRAY2D_CLOSE(" #x ", " #y ", " #sizex ", " #sizey ", " #tol ")") \
+  UnitTestArrayStats array_stats = \
+    UnitTestCompareArrays2D((x), (y), (sizex), (sizey), UnitTestClose(tol)); \
+  CHECK_WITH_MESSAGE(array_stats.Mismatches == 0, \
+    "CHECK_ARRAY2D_CLOSE(" #x ", " #y ", " #sizex ", " #sizey ", " #tol ")" \
+    << array_stats) \
+}
+
+//! A macro that causes the test to fail unless the ranges are equal.
+#define CHECK_RANGE_EQUAL(x, y) \
+{ \
+  UnitTestRangeStats range_stats = \
+    UnitTestCompareRanges((x), (y), UnitTestEqual()); \
+  CHECK_WITH_MESSAGE(range_stats.Result == UnitTestRangeStats::Equal, \
+    "CHECK_RANGE_EQUAL(" #x ", " #y ")" << range_stats) \
+}
+
+//! A macro that causes the test to fail unless the ranges are close.
+#define CHECK_RANGE_CLOSE(x, y, tol) \
+{ \
+  UnitTestRangeStats range_stats = \
+    UnitTestCompareRanges((x), (y), UnitTestClose(tol)); \
+  CHECK_WITH_MESSAGE(range_stats.Result == UnitTestRangeStats::Equal, \
+    "CHECK_RANGE_CLOSE(" #x ", " #y ", " #tol ")" << range_stats) \
+}
+
+//! A macro that causes the test to fail unless the sequences are equal.
+#define CHECK_ITERATORS_EQUAL(first1, last1, first2, last2) \
+{ \
+  UnitTestRangeStats range_stats = UnitTestCompareRanges( \
+    (first1), (last1), (first2), (last2), UnitTestEqual()); \
+  CHECK_WITH_MESSAGE(range_stats.Result == UnitTestRangeStats::Equal, \
+    "CHECK_ITERATORS_EQUAL(" #first1 ", " #last1 ", " \
+    #first2 ", " #last2 ")" << range_stats) \
+}
+
+//! A macro that causes the test to fail unless the files are equal.
+#define CHECK_FILES_EQUAL(file1, file2) \
+{ \
+  UnitTestFileStats file_stats = UnitTestCompareFiles((file1), (file2)); \
+  CHECK_WITH_DETAILS(file_stats.Result == UnitTestFileStats::Equal, \
+    "CHECK_FILES_EQUAL(" #file1 ", " #file2 ")" << file_stats, \
+    UnitTestHexDump(file_stats)) \
+}
+
+//! A macro that causes the test to fail unless the file matches the data.
+#define CHECK_FILE_MATCHES_BUFFER(file, data, size) \
+{ \
+  UnitTestFileStats file_stats = \
+    UnitTestCompareFiles((file), (data), (size)); \
+  CHECK_WITH_DETAILS(file_stats.Result == UnitTestFileStats::Equal, \
+    "CHECK_FILE_MATCHES_BUFFER(" #file ", " #data ", " #size ")" \
+    << file_stats, UnitTestHexDump(file_stats)) \
+}
+
+//! A macro that causes the test to fail unless the data matches a snapshot.
+#define CHECK_SNAPSHOT(name, data, size) \
+{ \
+  UnitTestFileStats file_stats = \
+    UnitTestCompareSnapshot((name), (data), (size)); \
+  CHECK_WITH_DETAILS(file_stats.Result == UnitTestFileStats::Equal, \
+    "CHECK_SNAPSHOT(" #name ", " #data ", " #size ")" << file_stats, \
+    UnitTestHexDump(file_stats)) \
+}
+
+#ifdef UNITTEST_EXCEPTIONS
+//! A macro that causes the test to fail unless "type" is thrown.
+#define CHECK_THROW(expression, type) \
+{ \
+  bool unitTestThrew = false; \
+  try { expression; } \
+  catch (const type &) { unitTestThrew = true; } \
+  catch (const UnitTestAbort &) { throw; } \
+  catch (...) {} \
+  CHECK_WITH_MESSAGE(unitTestThrew, \
+    "CHECK_THROW(" #expression ", " #type ")") \
+}
+
+//! A macro that causes the test to fail if an exception is thrown.
+#define CHECK_NOTHROW(expression) \
+{ \
+  bool unitTestThrew = false; \
+  std::string unitTestWhat = "unknown exception"; \
+  try { expression; } \
+  catch (const UnitTestAbort &) { throw; } \
+  catch (const std::exception &e) \
+    { unitTestThrew = true; unitTestWhat = e.what(); } \
+  catch (...) { unitTestThrew = true; } \
+  CHECK_WITH_MESSAGE(!unitTestThrew, \
+    "CHECK_NOTHROW(" #expression ") threw \"" << unitTestWhat << "\"") \
+}
+#else
+//! Without exceptions, a use of CHECK_THROW or CHECK_NOTHROW is an error.
+#define CHECK_THROW(expression, type) \
+UNITTEST_NEEDS_EXCEPTIONS(CHECK_THROW)
+#define CHECK_NOTHROW(expression) \
+UNITTEST_NEEDS_EXCEPTIONS(CHECK_NOTHROW)
+#ifdef UNITTEST_CXX11
+#define UNITTEST_NEEDS_EXCEPTIONS(macro) \
+static_assert(false, #macro " cannot be used without exceptions");
+#else
+#define UNITTEST_NEEDS_EXCEPTIONS(macro) \
+typedef char macro##_cannot_be_used_without_exceptions[-1];
+#endif
+#endif
+
+//! A macro that causes the test to fail unless the recorded histories are
+//! linearizable with respect to the model.
+#define CHECK_LINEARIZABLE(model, histories) \
+{ \
+  std::string linearizable_report = \
+    UnitTestCheckLinearizable((model), (histories)); \
+  CHECK_WITH_DETAILS(linearizable_report.empty(), \
+    "CHECK_LINEARIZABLE(" #model ", " #histories ")", \
+    linearizable_report) \
+}
+
+//! A macro that causes the test to fail if the rest of the enclosing scope
+//! takes more than the given number of milliseconds.
+#define UNITTEST_TIME_CONSTRAINT(ms) \
+static UnitTestSite unitTestTimeSite = { __FILE__, __LINE__, 0, 0 }; \
+UnitTestTimeConstraint unitTestTimeConstraint((ms), &unitTestTimeSite)
+
+//! A point where the schedule of the threads can be perturbed, for use in
+//! the code that is being tested.  It does nothing unless the code was
+//! compiled with UNITTEST_ENABLE_YIELD_POINTS.
+#ifdef UNITTEST_ENABLE_YIELD_POINTS
+#define UNITTEST_YIELD_POINT() UnitTestYieldPoint()
+#else
+#define UNITTEST_YIELD_POINT() ((void)0)
+#endif
+
+//! A macro that ends the test if the condition is false.  Without
+//! exceptions, it returns from the function instead.
+#ifdef UNITTEST_EXCEPTIONS
+#define REQUIRE_WITH_MESSAGE(t, m) \
+if (!(t)) \
+{ \
+  CHECK_WITH_MESSAGE(false, m) \
+  throw UnitTestAbort(); \
+}
+#else
+#define REQUIRE_WITH_MESSAGE(t, m) \
+if (!(t)) \
+{ \
+  CHECK_WITH_MESSAGE(false, m) \
+  return; \
 }
+#endif
+
+//! A macro that checks a boolean, the test ends if value is false.
+#define REQUIRE(t) \
+REQUIRE_WITH_MESSAGE(t, "REQUIRE(" #t ")")
+
+//! A macro that ends the test unless the values are equal.
+#define REQUIRE_EQUAL(expected, actual) \
+REQUIRE_WITH_MESSAGE((expected) == (actual), \
+  "REQUIRE_EQUAL(" #expected ", " #actual ")")
+
+//! A macro that ends the test unless the values are close.
+#define REQUIRE_CLOSE(x, y, tol) \
+REQUIRE_WITH_MESSAGE(fabs((x) - (y)) < (tol), \
+  "REQUIRE_CLOSE(" #x ", " #y ", " #tol ")")
+
+//! Run fn(thread) "iterations" times on each of the threads, all starting
+//! at the same time, and return the timing of each thread.
+#define UNITTEST_CONCURRENTLY(threads, iterations, fn) \
+UnitTestConcurrently((threads), (iterations), (fn), false, __FILE__, __LINE__)
+
+//! Like UNITTEST_CONCURRENTLY(), but with each thread pinned to a CPU.
+#define UNITTEST_CONCURRENTLY_PINNED(threads, iterations, fn) \
+UnitTestConcurrently((threads), (iterations), (fn), true, __FILE__, __LINE__)
 
 //! Use this macro to begin a test suite.
 #define SUITE(name) \
@@ -390,73 +5068,132 @@ inline const char *GetSuiteName() { return #name; } \
 } \
 namespace name
 
+//! Declare a fixture that is shared by all tests in the suite.
+#define SUITE_FIXTURE(fixture) \
+struct UnitTestSuiteTag; \
+inline const fixture &SuiteFixture() \
+{ \
+  return UnitTestSharedFixture<fixture, UnitTestSuiteTag>::Get( \
+    SuiteNamespace::GetSuiteName()); \
+}
+
+#ifdef UNITTEST_SECTION
+//! Place a constant-initialized test record in the registry section.
+//! The alignment is given, so the compiler cannot pad between records.
+#define UNITTEST_REGISTER(name, properties) \
+UnitTestInfo UnitTest_##name##_Info __attribute__((used, UNITTEST_RETAIN \
+  aligned(sizeof(void *)), section("unittest_registry"))) = \
+  { &SuiteNamespace::GetSuiteName, #name, __FILE__, __LINE__, \
+    properties, &UnitTest_##name::Run, 0 };
+#else
+//! Link a constant-initialized test record into the registry list.
+#define UNITTEST_REGISTER(name, properties) \
+UnitTestInfo UnitTest_##name##_Info = \
+  { &SuiteNamespace::GetSuiteName, #name, __FILE__, __LINE__, \
+    properties, &UnitTest_##name::Run, 0 }; \
+static UnitTestRegistrar UnitTest_##name##_Registrar(&UnitTest_##name##_Info);
+#endif
+
 //! Use this macro to begin a unit test.
-#define TEST(name) \
+#define TEST(name) TEST_PROPERTIES(name, "")
+
+//! Begin a unit test that has properties such as "tags=a,b timeout=10".
+#define TEST_PROPERTIES(name, properties) \
 class UnitTest_##name : UnitTest \
 { \
 public: \
   UnitTest_##name() : UnitTest(SuiteNamespace::GetSuiteName(), #name) {} \
+  static void Run() { UnitTest_##name test; test(); } \
 protected: \
   void operator() (); \
-} UnitTest_##name##_Instance; \
+}; \
+UNITTEST_REGISTER(name, properties) \
 void UnitTest_##name::operator() ()
 
 //! Create a test with "fixture" as its base class.
 #define TEST_FIXTURE(fixture, name) \
+TEST_FIXTURE_PROPERTIES(fixture, name, "")
+
+//! Create a test with "fixture" as its base class, and with properties.
+#define TEST_FIXTURE_PROPERTIES(fixture, name, properties) \
 class UnitTest_##name : UnitTest, fixture \
 { \
 public: \
   UnitTest_##name() : UnitTest(SuiteNamespace::GetSuiteName(), #name) {} \
-protected: \
+  static void Run() \
+  { \
+    UnitTestFixtureRunner<UnitTest_##name> runner; \
+    runner.Run(); \
+  } \
   void operator() (); \
-} UnitTest_##name##_Instance; \
+}; \
+UNITTEST_REGISTER(name, properties) \
 void UnitTest_##name::operator() ()
 
+//! Define a benchmark, which calls KeepRunning() in a loop.
+#define BENCHMARK(name) \
+TEST_FIXTURE_PROPERTIES(UnitTestBenchmark, name, "benchmark")
+
+//! Define a benchmark with properties.
+#define BENCHMARK_PROPERTIES(name, properties) \
+TEST_FIXTURE_PROPERTIES(UnitTestBenchmark, name, "benchmark " properties)
+
 //! Call this macro to auto-generate a main() function.
 #define TEST_MAIN() \
-std::vector<UnitTest *> *UnitTest::Tests; \
+UnitTestInfo *UnitTest::TestList; \
+UnitTestInfo **UnitTest::TestListTail = &UnitTest::TestList; \
+bool UnitTest::TestsSorted = false; \
 bool UnitTest::TestFailed; \
-static size_t schwarzCounter = 0; \
-UnitTestInitializer::UnitTestInitializer() \
-{ \
-  if (schwarzCounter++ == 0) \
-  { \
-    UnitTest::Tests = new std::vector<UnitTest *>; \
-  } \
-} \
-UnitTestInitializer::~UnitTestInitializer() \
-{ \
-  if (--schwarzCounter == 0) \
-  { \
-    delete UnitTest::Tests; \
-  } \
-} \
+UnitTestSite *UnitTest::FailedSites; \
+UNITTEST_THREAD_LOCAL unsigned long UnitTest::ThreadFailures; \
+UnitTestSuiteFixture *UnitTest::SuiteFixtures; \
+double UnitTest::SetupTime; \
+std::string UnitTest::TestNotes; \
+unsigned long UnitTest::FailuresPerSite = 10; \
+size_t UnitTest::ParallelThreshold = 1 << 22; \
+unsigned long UnitTest::MaxThreads = 0; \
+const char *UnitTest::SnapshotDirectory = "snapshots"; \
+bool UnitTest::UpdateSnapshots = false; \
+const char *UnitTest::CacheDirectory; \
+bool UnitTest::UseCache = true; \
+bool UnitTest::FailedFirst = false; \
+unsigned long UnitTest::HistoryLength = 5; \
+unsigned long UnitTest::MaxFailures = 0; \
+bool UnitTest::ResumeOnCrash = true; \
+UnitTestInfo *volatile UnitTest::CurrentTest; \
+char **UnitTest::ResumeArgv; \
+char UnitTest::ResumeArg[4096]; \
+const char *UnitTest::ResumePoint; \
+std::string UnitTest::ResumeFile; \
+unsigned long UnitTest::RepeatCount = 0; \
+bool UnitTest::UntilFail = false; \
+unsigned long UnitTest::Seed = 0; \
+UNITTEST_THREAD_LOCAL unsigned long UnitTest::RunSeed; \
+unsigned long UnitTest::StressThreads = 0; \
+double UnitTest::StressTime = 0.0; \
+UNITTEST_THREAD_LOCAL unsigned long UnitTest::StressThread; \
+double UnitTest::TickSeconds = 0.0; \
+uint64_t UnitTest::TickBase = 0; \
+double UnitTest::TickOrigin = 0.0; \
+double UnitTest::TimerOverhead = 0.0; \
+UnitTestCounter UnitTest::TimerReady(0); \
+UNITTEST_THREAD_LOCAL bool UnitTest::TimerCalibrating = false; \
+bool UnitTest::Benchmarking = false; \
+double UnitTest::BenchmarkTime = 0.5; \
+double UnitTest::PauseOverhead = 0.0; \
+bool UnitTest::PinThreads = false; \
+bool UnitTest::PinCores = false; \
+bool UnitTest::PinNodes = false; \
+std::vector<UnitTestNumaNode> UnitTest::PinnedNodes; \
+const char *UnitTest::CpuList; \
+std::vector<int> UnitTest::PinnedCpus; \
+std::vector<int> UnitTest::ProcessCpus; \
+bool UnitTest::YieldPoints = false; \
+UNITTEST_THREAD_LOCAL uint64_t UnitTest::YieldState; \
+const char *UnitTest::Executable; \
 int main(int argc, char *argv[]) \
 { \
-  if (argc > 1) \
-  { \
-    if (argc > 2) \
-    { \
-      std::cerr << "Too many arguments to test program " << argv[0] << "\n"; \
-      return 1; \
-    } \
-    if (argv[1][0] == '-') \
-    { \
-      if (strcmp("--list", argv[1]) == 0) \
-      { \
-        UnitTest::ListAllTests(); \
-        return 0; \
-      } \
-      else \
-      { \
-        std::cerr << "Unrecognized option \"" << argv[1] \
-                  << "\" for test program " << argv[0] << "\n"; \
-        return 1; \
-      } \
-    } \
-    return UnitTest::RunTest(argv[1]); \
-  } \
-  return UnitTest::RunAllTests(); \
+  return UnitTest::Main(argc, argv); \
 }
 
 #endif /* UNITTEST_H */